@@ -3,23 +3,18 @@
 #include <linux/interrupt.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/of.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
 #include <linux/sysfs.h>
 
-#define MATR_A_START        0x000
-#define MATR_A_END	        0x190 	//0x000 + 100 * 4
-#define MATR_B_START        0x200
-#define MATR_B_END	        0x228 	//0x210 + 10 * 4
-#define	MATR_C_START        0x300
-#define	MATR_C_END	        0x328	//0x300 + 10 * 4
-
 #define CONTROL_REG         0x400
 #define BIT_C_ENABLE        BIT(0)
 #define BIT_C_END_OP_IRQ_EN BIT(1)
 #define BIT_C_START_OP      BIT(2)
 #define BIT_C_RESET_STAT    BIT(3)  //also reset irq
+#define BIT_C_CNT_RESET     BIT(7)  //zero the performance counters
 #define DEFAULT_CTRL_REG    0x01
 
 #define SIZE_REG            0x410
@@ -32,14 +27,51 @@
 #define ID_REG              0x430
 #define CHIP_ID             0xc1a0
 
-#define MAX_SIZE            10
-#define MAX_SIZE_QUAD       100
+//performance counters (readonly), 64 bit LO/HI words every CNT_STRIDE
+#define CNT_BASE            0x440
+#define CNT_STRIDE          0x10
+#define CNT_JOBS            0
+#define CNT_MACS            1
+#define CNT_WIN_RD_BYTES    2
+#define CNT_WIN_WR_BYTES    3
+#define CNT_BUSY_NS         4
+#define CNT_IRQS            5
+
+//capabilities (readonly), the driver reads limits and window offsets from here
+#define CAP_MAX_SIZE_REG    0x600
+#define CAP_MATRA_OFF_REG   0x610
+#define CAP_MATRB_OFF_REG   0x620
+#define CAP_MATRC_OFF_REG   0x630
+
+// A sysfs write is at most one page and every value takes at least two characters ("0,")
+#define STAGING_WORDS       (PAGE_SIZE / 2)
 
 struct virt_mulmatr {
     struct device *dev;
     void __iomem *base;
+
+    u32 max_size;
+    u32 matra_off;
+    u32 matrb_off;
+    u32 matrc_off;
+
+    // Staging of the matrA/matrB writes, allocated once at probe time
+    struct mutex staging_lock;      // Also serializes strtok_custom(), it keeps a static pointer
+    u32 *staging;                   // STAGING_WORDS parsed values
+    char *text;                     // Terminated copy of the written text, PAGE_SIZE + 1 bytes
 };
 
+// Copy the written text to vf->text, newlines turned into commas; staging_lock held
+static char *vf_stage_text(struct virt_mulmatr *vf, const char *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        vf->text[i] = (buf[i] == '\n') ? ',' : buf[i];
+    vf->text[len] = '\0';
+    return vf->text;
+}
+
 // Implementation of strtok (at kernel level it does not exist)
 char *strtok_custom(char *str, char *delim) {
     static char *saved_str;
@@ -145,7 +177,7 @@ static ssize_t vf_store_size(struct device *dev,
     if (kstrtoul(buf, 0, &val))
         return -EINVAL;
 
-    val = (val <= MAX_SIZE) ? val : MAX_SIZE;
+    val = (val <= vf->max_size) ? val : vf->max_size;
 
     writel_relaxed(val, vf->base + SIZE_REG);
 
@@ -190,7 +222,7 @@ static ssize_t matrA_show(struct device *dev,
     int len_matr = (int)readl_relaxed(vf->base + SIZE_REG);
     int len_matr_quad = len_matr * len_matr;
 
-    reg_base = vf->base + MATR_A_START;
+    reg_base = vf->base + vf->matra_off;
     for (i = 0; i < len_matr_quad; i++) {
         if((i + 1) % len_matr == 0) // To print the \n only at end of line
             written_chars += scnprintf(buf+written_chars, PAGE_SIZE-written_chars, "0x%x\n", readl_relaxed(reg_base + (i * 4)));
@@ -214,44 +246,33 @@ static ssize_t matrA_store(struct device *dev,
     int i, data_to_store, max_len_matr, size_matr;
     void __iomem *reg_base;
     int readed_datas;
-    char *newbuf;
 
     printk(KERN_DEBUG "KERNEL: %d data recived: -%.*s-\n", len, len, buf);
 
+    if (len > PAGE_SIZE)
+        return -EINVAL;
+
     size_matr = (int)readl_relaxed(vf->base + SIZE_REG);
-    max_len_matr = size_matr * size_matr;
-    
-    data = kmalloc(sizeof(u32)*max_len_matr, GFP_KERNEL);
-    if (!data) {
-        printk(KERN_ERR "KERNEL: matrA_store - Error allocating dynamic mem\n");
-        return -EFAULT;
-    }
+    max_len_matr = min_t(int, size_matr * size_matr, STAGING_WORDS);
 
-    newbuf = kmalloc(sizeof(char)*len, GFP_KERNEL);
-    if (!newbuf) {
-        printk(KERN_ERR "KERNEL: matrA_store - Error allocating dynamic mem\n");
-        return -EFAULT;
-    }
-    
-    //Substituting /n with , to use the function parse_hex_string
-    for (i = 0; i < len; i++) {
-        newbuf[i] = (buf[i] == '\n') ? ',' : buf[i];
-    }
+    mutex_lock(&vf->staging_lock);
+    data = vf->staging;
 
-    readed_datas = parse_hex_string(newbuf, len, data, max_len_matr);
+    //Substituting /n with , to use the function parse_hex_string
+    readed_datas = parse_hex_string(vf_stage_text(vf, buf, len), len, data, max_len_matr);
 
     printk(KERN_DEBUG "KERNEL: %d data converted:", readed_datas);
     for(i = 0; i < readed_datas; i++)
         printk(KERN_DEBUG "\t\t%d ", data[i]);
 
     data_to_store = (max_len_matr > readed_datas) ? readed_datas : max_len_matr;
-    reg_base = vf->base + MATR_A_START;
+    reg_base = vf->base + vf->matra_off;
 
     for (i = 0; i < data_to_store; i++) {
         writel_relaxed(data[i], reg_base + (i * 4));
     }
     
-    kfree(data);
+    mutex_unlock(&vf->staging_lock);
     return len;
 }
 
@@ -271,7 +292,7 @@ static ssize_t matrB_show(struct device *dev,
 
     int len_matr = (int)readl_relaxed(vf->base + SIZE_REG);
 
-    reg_base = vf->base + MATR_B_START;
+    reg_base = vf->base + vf->matrb_off;
     for (i = 0; i < len_matr; i++) {
         if(i < len_matr - 1)
             written_chars += scnprintf(buf+written_chars, PAGE_SIZE-written_chars, "0x%x,", readl_relaxed(reg_base + (i * 4)));
@@ -297,28 +318,29 @@ static ssize_t matrB_store(struct device *dev,
 
     printk(KERN_DEBUG "KERNEL: %d data recived: -%.*s-\n", len, len, buf);
 
-    max_len_matr = (int)readl_relaxed(vf->base + SIZE_REG);
-    
-    data = kmalloc(sizeof(u32)*max_len_matr, GFP_KERNEL);
-    if (!data) {
-        printk(KERN_ERR "KERNEL: matrB_store - Error allocating dynamic mem\n");
-        return -EFAULT;
-    }
+    if (len > PAGE_SIZE)
+        return -EINVAL;
 
-    readed_datas = parse_hex_string(buf, len, data, max_len_matr);
+    max_len_matr = min_t(int, readl_relaxed(vf->base + SIZE_REG), STAGING_WORDS);
+
+    mutex_lock(&vf->staging_lock);
+    data = vf->staging;
+
+    // The sysfs buffer is const, the parser cuts the tokens of the copy
+    readed_datas = parse_hex_string(vf_stage_text(vf, buf, len), len, data, max_len_matr);
 
     printk(KERN_DEBUG "KERNEL: %d data converted:", readed_datas);
     for(i = 0; i < readed_datas; i++)
         printk(KERN_DEBUG "\t\t%d ", data[i]);
 
     data_to_store = (max_len_matr > readed_datas) ? readed_datas : max_len_matr;
-    reg_base = vf->base + MATR_B_START;
+    reg_base = vf->base + vf->matrb_off;
 
     for (i = 0; i < data_to_store; i++) {
         writel_relaxed(data[i], reg_base + (i * 4));
     }
     
-    kfree(data);
+    mutex_unlock(&vf->staging_lock);
     return len;
 }
 
@@ -337,7 +359,7 @@ static ssize_t matrC_show(struct device *dev,
 
     int len_matr = (int)readl_relaxed(vf->base + SIZE_REG);
 
-    reg_base = vf->base + MATR_C_START;
+    reg_base = vf->base + vf->matrc_off;
     for (i = 0; i < len_matr; i++) {
         if(i < len_matr - 1)
             written_chars += scnprintf(buf+written_chars, PAGE_SIZE-written_chars, "0x%x,", readl_relaxed(reg_base + (i * 4)));
@@ -348,6 +370,50 @@ static ssize_t matrC_show(struct device *dev,
     return written_chars; // Restituiamo la lunghezza dei dati letti
 }
 
+// Read a 64 bit counter, HI is read again in case LO wrapped in between
+static u64 vf_read_counter(struct virt_mulmatr *vf, int idx)
+{
+    void __iomem *reg = vf->base + CNT_BASE + idx * CNT_STRIDE;
+    u32 hi, lo;
+
+    do {
+        hi = readl_relaxed(reg + 4);
+        lo = readl_relaxed(reg);
+    } while (hi != readl_relaxed(reg + 4));
+
+    return ((u64)hi << 32) | lo;
+}
+
+#define VF_COUNTER_ATTR(_name, _idx)                                        \
+static ssize_t vf_show_##_name(struct device *dev,                          \
+                               struct device_attribute *attr, char *buf)    \
+{                                                                           \
+    struct virt_mulmatr *vf = dev_get_drvdata(dev);                         \
+                                                                            \
+    return scnprintf(buf, PAGE_SIZE, "%llu\n", vf_read_counter(vf, _idx));  \
+}                                                                           \
+static DEVICE_ATTR(_name, S_IRUGO, vf_show_##_name, NULL)
+
+VF_COUNTER_ATTR(jobs,         CNT_JOBS);
+VF_COUNTER_ATTR(macs,         CNT_MACS);
+VF_COUNTER_ATTR(win_rd_bytes, CNT_WIN_RD_BYTES);
+VF_COUNTER_ATTR(win_wr_bytes, CNT_WIN_WR_BYTES);
+VF_COUNTER_ATTR(busy_ns,      CNT_BUSY_NS);
+VF_COUNTER_ATTR(irqs,         CNT_IRQS);
+
+// Any write zeroes all the counters
+static ssize_t vf_store_counters_reset(struct device *dev,
+                                       struct device_attribute *attr,
+                                       const char *buf, size_t len)
+{
+    struct virt_mulmatr *vf = dev_get_drvdata(dev);
+    u32 val = readl_relaxed(vf->base + CONTROL_REG);
+
+    writel_relaxed(val | BIT_C_CNT_RESET, vf->base + CONTROL_REG);
+
+    return len;
+}
+
 static DEVICE_ATTR(control, S_IRUGO | S_IWUSR, vf_show_control, vf_store_control);
 static DEVICE_ATTR(size,    S_IRUGO | S_IWUSR, vf_show_size,    vf_store_size);
 static DEVICE_ATTR(status,  S_IRUGO, vf_show_status,    NULL);
@@ -357,6 +423,8 @@ static DEVICE_ATTR(matrA, S_IRUGO | S_IWUSR, matrA_show, matrA_store);
 static DEVICE_ATTR(matrB, S_IRUGO | S_IWUSR, matrB_show, matrB_store);
 static DEVICE_ATTR(matrC, S_IRUGO, matrC_show, NULL);
 
+static DEVICE_ATTR(counters_reset, S_IWUSR, NULL, vf_store_counters_reset);
+
 static struct attribute *vf_attributes[] = {
     &dev_attr_control.attr,
     &dev_attr_size.attr,
@@ -365,6 +433,13 @@ static struct attribute *vf_attributes[] = {
     &dev_attr_matrA.attr,
     &dev_attr_matrB.attr,
     &dev_attr_matrC.attr,
+    &dev_attr_jobs.attr,
+    &dev_attr_macs.attr,
+    &dev_attr_win_rd_bytes.attr,
+    &dev_attr_win_wr_bytes.attr,
+    &dev_attr_busy_ns.attr,
+    &dev_attr_irqs.attr,
+    &dev_attr_counters_reset.attr,
     NULL,
 };
 
@@ -374,7 +449,13 @@ static const struct attribute_group vf_attr_group = {
 
 static void vf_init(struct virt_mulmatr *vf)
 {
+    // A disabled device reads as 0, enable it before reading the CAP registers
     writel_relaxed(DEFAULT_CTRL_REG, vf->base + CONTROL_REG);
+
+    vf->max_size = readl_relaxed(vf->base + CAP_MAX_SIZE_REG);
+    vf->matra_off = readl_relaxed(vf->base + CAP_MATRA_OFF_REG);
+    vf->matrb_off = readl_relaxed(vf->base + CAP_MATRB_OFF_REG);
+    vf->matrc_off = readl_relaxed(vf->base + CAP_MATRC_OFF_REG);
 }
 
 static irqreturn_t vf_irq_handler(int irq, void *data)
@@ -410,6 +491,13 @@ static int vf_probe(struct platform_device *pdev)
     if (!vf->base)
         return -EINVAL;
 
+    // The matrix writes reuse these instead of allocating on every store
+    mutex_init(&vf->staging_lock);
+    vf->staging = devm_kcalloc(dev, STAGING_WORDS, sizeof(u32), GFP_KERNEL);
+    vf->text = devm_kzalloc(dev, PAGE_SIZE + 1, GFP_KERNEL);
+    if (!vf->staging || !vf->text)
+        return -ENOMEM;
+
     res = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
     if (res) {
         ret = devm_request_irq(dev, res->start, vf_irq_handler,
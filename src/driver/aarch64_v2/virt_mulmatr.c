@@ -1,20 +1,22 @@
+#include <linux/cdev.h>
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
+#include <linux/eventfd.h>
 #include <linux/io.h>
 #include <linux/interrupt.h>
+#include <linux/iopoll.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/of.h>
+#include <linux/percpu.h>
 #include <linux/platform_device.h>
+#include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/sysfs.h>
-
-// Define memory addresses for matrices
-#define MATR_A_START        0x000
-#define MATR_A_END	        0x190 	// 100 elements (0x000 + 100 * 4 bytes)
-#define MATR_B_START        0x200
-#define MATR_B_END	        0x228 	// 10 elements (0x210 + 10 * 4 bytes)
-#define	MATR_C_START        0x300
-#define	MATR_C_END	        0x328	// 10 elements (0x300 + 10 * 4 bytes)
+#include <linux/wait.h>
 
 // Define control register flags
 #define CONTROL_REG         0x400   // Address of the control register
@@ -22,6 +24,22 @@
 #define BIT_C_END_OP_IRQ_EN BIT(1)  // Enable IRQ at end of operation
 #define BIT_C_START_OP      BIT(2)  // Start the operation
 #define BIT_C_RESET_STAT    BIT(3)  // Reset the status (includes IRQ reset)
+#define BIT_C_DMA_MODE      BIT(4)  // Move operands and result through DMA
+#define BIT_C_QUEUE_EN      BIT(5)  // Process the submission queue (0->1 resets it)
+#define BIT_C_USE_SLOT      BIT(6)  // Take A from the slot in SLOT_REG
+#define BIT_C_CNT_RESET     BIT(7)  // Zero the performance counters
+#define CTRL_FMT_SHIFT      8               // Element format field
+#define CTRL_FMT_MASK       GENMASK(9, 8)   // Element format of A and B
+#define CTRL_FMT_INT32      0               // One element per word
+#define CTRL_FMT_INT16      1               // 2 elements per word, first in the low half
+#define CTRL_FMT_INT8       2               // 4 elements per word, first in the low byte
+#define BIT_C_CSR           BIT(10) // A is sparse (CSR), DMA_A_ADDR points to the row pointers
+#define BIT_C_ACCUM         BIT(11) // C = alpha x A x b + beta x C
+#define CTRL_OP_MASK        GENMASK(13, 12) // Operation field
+#define CTRL_OP_GEMV        (0 << 12)       // C = A x b
+#define CTRL_OP_GEMM        (1 << 12)       // C = A x B, B is size x k (DMA mode only)
+#define CTRL_OP_LOAD_SLOT   (2 << 12)       // Store A in the slot in SLOT_REG
+#define CTRL_OP_FREE_SLOT   (3 << 12)       // Release the slot in SLOT_REG
 #define DEFAULT_CTRL_REG    0x01    // Default control register value
 
 // Define matrix size register
@@ -32,15 +50,69 @@
 #define STATUS_REG	        0x420   // Address of the status register
 #define BIT_S_OP_STARTED    BIT(0)  // Flag indicating operation has started
 #define BIT_S_OP_ENDED      BIT(1)  // Flag indicating operation has ended
+#define BIT_S_DMA_ERR       BIT(2)  // Flag indicating a failed DMA transfer
+#define BIT_S_CMD_ERR       BIT(3)  // Flag indicating an invalid operation
+#define BIT_S_QUEUE_DONE    BIT(4)  // Flag indicating a batch of completions was posted
+#define BIT_S_QUEUE_BUSY    BIT(5)  // Flag indicating a queued job is still running
 
 // Device ID register
 #define ID_REG              0x430   // Address of the ID register
 
-#define MAX_SIZE            10      // Maximum size for the flat matrices (10 x 1 or 1 x 10)
-#define MAX_SIZE_QUAD       100     // Max size for the square matrix (10 x 10)
-
+// Performance counters (read only), 64 bit LO/HI words every CNT_STRIDE
+#define CNT_BASE            0x440   // Address of the first counter
+#define CNT_STRIDE          0x10    // Distance between two counters
+#define CNT_NUM             6       // Counters in struct mulmatr_counters order
+
+// DMA address registers (64 bit guest-physical addresses, LO/HI words)
+#define DMA_A_ADDR_LO       0x500   // Address of matrix A in RAM, low word
+#define DMA_A_ADDR_HI       0x504   // Address of matrix A in RAM, high word
+#define DMA_B_ADDR_LO       0x510   // Address of matrix B in RAM, low word
+#define DMA_B_ADDR_HI       0x514   // Address of matrix B in RAM, high word
+#define DMA_C_ADDR_LO       0x520   // Address of matrix C in RAM, low word
+#define DMA_C_ADDR_HI       0x524   // Address of matrix C in RAM, high word
+
+// Capability registers (read only), they describe the matrix windows
+#define CAP_MAX_SIZE_REG    0x600   // Maximum matrix size supported by the device
+#define CAP_MATRA_OFF_REG   0x610   // Offset of the matrix A window
+#define CAP_MATRB_OFF_REG   0x620   // Offset of the matrix B window
+#define CAP_MATRC_OFF_REG   0x630   // Offset of the matrix C window
+#define CAP_SLOTS_REG       0x640   // Number of matrix slots
+
+// Operation parameters
+#define K_REG               0x700   // Columns of B and C in GEMM mode
+#define SLOT_REG            0x710   // Slot used by load/free and by BIT_C_USE_SLOT
+#define ALPHA_REG           0x720   // Scale of the product with BIT_C_ACCUM
+#define BETA_REG            0x730   // Scale of the previous C with BIT_C_ACCUM
+#define MAX_SLOTS           64      // Most slots a device can have
+#define SLOT_GEN_MASK       GENMASK(23, 0)  // Generation bits a handle has room for
+
+// Sparse A (BIT_C_CSR), 64 bit guest-physical addresses (LO/HI words)
+#define CSR_COL_ADDR_LO     0x900   // Address of the column indexes, low word
+#define CSR_VAL_ADDR_LO     0x910   // Address of the values, low word
+#define NNZ_REG             0x920   // Stored entries of A
+
+// Submission/completion queues in RAM
+#define SQ_BASE_LO          0x800   // Address of the submission queue, low word
+#define CQ_BASE_LO          0x810   // Address of the completion queue, low word
+#define Q_SIZE_REG          0x820   // Entries of both queues
+#define SQ_TAIL_DB          0x830   // Submission tail doorbell
+#define CQ_HEAD_DB          0x850   // Completion head doorbell
+#define Q_ENTRIES           32      // Queue depth, Q_ENTRIES - 1 jobs in flight
+
+#define OP_TIMEOUT_US       (10 * USEC_PER_SEC)     // Max wait for an operation
+#define XFER_CHUNK          64      // Words bounced through the stack between user space and a window (even)
+
+// Staging pool: power of two size classes from 2^POOL_MIN_SHIFT words
+#define POOL_MIN_SHIFT      6       // Smallest class, 64 words
+#define POOL_CLASSES        20      // Largest class 2^25 words, a 4096 x 4096 matrix fits
+#define POOL_DEPTH          4       // Buffers kept per class besides the per-CPU ones
+#define POOL_PREALLOC_WORDS (1 << 18)   // Biggest class filled at probe time (1 MiB)
+#define POOL_CPU_CLASSES    8       // Classes cached per CPU, up to 2^13 words (32 KiB)
 
 #define DEVICE_NAME "mulmatr_core" /* Dev name as it appears in /proc/devices   */
+#define LB_DEVICE_NAME      "mulmatr"   // Node spreading files and jobs over the instances
+#define VM_MAX_DEVICES      8           // Instances served, minors 0 .. VM_MAX_DEVICES - 1
+#define VM_LB_MINOR         VM_MAX_DEVICES  // Minor of /dev/mulmatr
 
 // IOCTL command definitions for interacting with the device
 #define RD_ID               _IOR('a','b',int32_t*)      // Read device ID
@@ -63,481 +135,2553 @@
 #define WR_MATRB            _IOR('a','o',int32_t*)      // Write data to matrix B
 #define RD_MATRC            _IOR('a','p',int32_t*)      // Read data from matrix C
 
+// C = A x B in a single call, B and C are size x k (row major)
+struct mulmatr_gemm {
+    __u32 size;             // Rows and columns of A
+    __u32 k;                // Columns of B and C
+    __s32 __user *a;        // size x size
+    __s32 __user *b;        // size x k
+    __s32 __user *c;        // size x k, filled by the driver
+    __u32 slot;             // Handle from MULMATR_SLOT_LOAD used instead of 'a', 0 for none
+    __u32 pad;
+};
+
+#define MULMATR_GEMM        _IOWR('a','q',struct mulmatr_gemm)  // Run a whole GEMM
+
+// Many GEMMs through the submission queue, 'done' counts the completed ones
+struct mulmatr_batch {
+    __u32 count;                        // Entries in 'jobs'
+    __u32 done;                         // Filled by the driver
+    struct mulmatr_gemm __user *jobs;
+};
+
+#define MULMATR_BATCH       _IOWR('a','r',struct mulmatr_batch) // Run a batch of GEMMs
+
+// A matrix kept in the device, jobs refer to it through 'handle'
+struct mulmatr_slot {
+    __u32 handle;           // Filled by MULMATR_SLOT_LOAD
+    __u32 size;             // Rows and columns of A
+    __s32 __user *a;        // size x size
+    __u32 flags;            // MULMATR_SLOT_PINNED
+    __u32 pad;
+};
+
+#define MULMATR_SLOT_PINNED 0x1     // Never evicted to make room for another load
+
+#define MULMATR_SLOT_LOAD   _IOWR('a','s',struct mulmatr_slot)  // Upload A, get a handle
+#define MULMATR_SLOT_PIN    _IOW('a','t',struct mulmatr_slot)   // Change the flags of a handle
+#define MULMATR_SLOT_FREE   _IOW('a','u',__u32)                 // Release a handle
+
+// Snapshot of the device performance counters
+struct mulmatr_counters {
+    __u64 jobs;             // Operations completed
+    __u64 macs;             // Multiply-accumulates executed
+    __u64 win_rd_bytes;     // Bytes read from the matrix windows
+    __u64 win_wr_bytes;     // Bytes written to the matrix windows
+    __u64 busy_ns;          // Virtual time spent running operations
+    __u64 irqs;             // Interrupts raised
+};
+
+#define RD_COUNTERS         _IOR('a','v',struct mulmatr_counters) // Read the counters
+#define CTRL_RESET_CNT      _IOR('a','w',int32_t*)      // Zero the counters
+#define WR_FORMAT           _IOR('a','x',int32_t*)      // Select the format of A and B (CTRL_FMT_*)
+
+// C = A x B with a sparse A in CSR form, B and C are size x k (row major)
+struct mulmatr_csr {
+    __u32 size;             // Rows and columns of A
+    __u32 k;                // Columns of B and C
+    __u32 nnz;              // Stored entries of A
+    __u32 pad;
+    __u32 __user *rowptr;   // size + 1 offsets in colidx/values, rowptr[size] == nnz
+    __u32 __user *colidx;   // nnz column indexes
+    __s32 __user *values;   // nnz values
+    __s32 __user *b;        // size x k
+    __s32 __user *c;        // size x k, filled by the driver
+};
+
+#define MULMATR_CSR         _IOWR('a','y',struct mulmatr_csr)   // Run a sparse GEMM
+
+// Accumulate mode of the register operations: C = alpha x A x b + beta x C
+struct mulmatr_accum {
+    __u32 enable;           // 0 to overwrite C again
+    __s32 alpha;
+    __s32 beta;
+    __u32 pad;
+};
+
+#define CTRL_ACCUM          _IOW('a','z',struct mulmatr_accum)  // Set the accumulate mode
+
+// C = A x b in a single call: program the device, sleep until it completes, copy C back
+struct mulmatr_submit {
+    __u32 size;             // Rows and columns of A
+    __u32 flags;            // MULMATR_SUBMIT_*
+    __s32 __user *a;        // size x size
+    __s32 __user *b;        // size
+    __s32 __user *c;        // size, filled by the driver
+};
+
+#define MULMATR_SUBMIT_KEEP_A   0x1     // Reuse the A left in the device by the previous operation
+
+#define MULMATR_SUBMIT      _IOWR('a','A',struct mulmatr_submit)    // Run a GEMV and wait for it
+#define MULMATR_WAIT        _IOR('a','B',__u32)         // Sleep until the started operation ends, get the status
+#define MULMATR_SET_EVENTFD _IOW('a','C',__s32)         // Signal an eventfd at every end of operation, -1 to stop
+
+// Submission entry, as read by the device
+struct vm_sqe {
+    __le32 ctrl;            // Operation, same encoding as the control register
+    __le32 size;
+    __le32 k;
+    __le32 tag;             // Returned in the completion
+    __le64 a_addr;
+    __le64 b_addr;
+    __le64 c_addr;
+    __le32 slot;            // Used with BIT_C_USE_SLOT
+    __le32 rsvd0;
+    __le64 rsvd[2];
+};
+
+// Completion entry, as written by the device
+struct vm_cqe {
+    __le32 tag;
+    __le32 status;          // BIT_S_OP_ENDED and the error bits of the job
+    __le32 sq_head;
+    __le32 phase;           // Bit 0 flips at every pass over the queue
+};
+
+// Staging memory of one queue entry: A, B and C back to back
+struct vm_qentry {
+    u32 *buf;
+    size_t words;
+    dma_addr_t handle;
+    size_t c_off;           // Words before C
+    struct mulmatr_gemm req;
+};
+
+// Driver view of a device slot
+struct vm_mslot {
+    u32 size;               // 0 if the slot is free
+    u32 gen;                // Bumped at every load, stale handles stop matching
+    bool pinned;
+    struct vm_file *owner;  // File that loaded it, the only one that can use or free it
+    u64 last_use;
+};
+
+// One cached buffer per class on every CPU, taken and given back without the pool lock
+struct vm_pool_cpu {
+    u32 *buf[POOL_CLASSES];
+};
+
+// Staging memory of the contexts and of the transfers, kept instead of freed
+struct vm_pool {
+    spinlock_t lock;                        // Protects free and nfree
+    u32 *free[POOL_CLASSES][POOL_DEPTH];
+    u32 nfree[POOL_CLASSES];
+    struct vm_pool_cpu __percpu *cpu;       // NULL if the per-CPU allocation failed
+};
+
+struct virt_mulmatr;
+struct vm_file;
+
 static int device_open(struct inode *inode, struct file *file);
 static int device_release(struct inode *inode, struct file *file);
 static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static long vm_ioctl(struct vm_file *vf, unsigned int cmd, unsigned long arg);
+static ssize_t device_read(struct file *file, char __user *buf, size_t count, loff_t *ppos);
+static __poll_t device_poll(struct file *file, struct poll_table_struct *wait);
+static int device_mmap(struct file *file, struct vm_area_struct *vma);
+static long vm_gemm(struct virt_mulmatr *vm, struct vm_file *vf, const struct mulmatr_gemm *req);
+static long vm_submit(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_submit __user *uarg);
+static int vm_wait_op(struct virt_mulmatr *vm, u32 events, u32 *status);
+static long vm_set_eventfd(struct vm_file *vf, int fd);
+static int vm_ctx_reserve(struct vm_file *vf, u32 size);
+static void vm_ctx_free(struct vm_file *vf);
+static u32 *vm_pool_get(struct virt_mulmatr *vm, size_t words);
+static void vm_pool_put(struct virt_mulmatr *vm, u32 *buf, size_t words);
+static void vm_pool_trim(struct virt_mulmatr *vm);
+static void vm_pool_fini(struct virt_mulmatr *vm);
+static long vm_ctx_start(struct vm_file *vf);
+static int vm_ctx_retire(struct virt_mulmatr *vm);
+static int vm_dev_lock(struct virt_mulmatr *vm, struct vm_file *vf);
+static void vm_dev_unlock(struct virt_mulmatr *vm, struct vm_file *submit_owner);
+static struct virt_mulmatr *vm_lb_pick(void);
+static struct virt_mulmatr *vm_get(unsigned int index);
+static void vm_put(struct virt_mulmatr *vm);
+static long vm_lb_ioctl(struct vm_file *vf, unsigned int cmd, unsigned long arg);
+static long vm_csr(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_csr __user *uarg);
+static long vm_batch(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_batch __user *uarg);
+static long vm_slot_load(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_slot __user *uarg);
+static long vm_slot_pin(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_slot __user *uarg);
+static long vm_slot_free(struct virt_mulmatr *vm, struct vm_file *vf, u32 handle);
+static bool vm_slot_release(struct virt_mulmatr *vm, struct vm_file *vf);
+static void vm_read_counters(struct virt_mulmatr *vm, struct mulmatr_counters *cnt);
+static u32 vm_fmt_per_word(u32 ctrl);
+static u32 vm_pack(u32 *buf, u32 count, u32 per_word);
+static void vm_unpack(u32 *buf, u32 count, u32 per_word);
+static void vm_win_write(void __iomem *win, const u32 *src, size_t words);
+static void vm_win_read(u32 *dst, const void __iomem *win, size_t words);
+static int vm_win_from_user(void __iomem *win, const void __user *src, size_t words);
+static int vm_win_to_user(void __user *dst, const void __iomem *win, size_t words);
 
 struct virt_mulmatr {
     struct device *dev;     
     void __iomem *base;
+    phys_addr_t phys;       // Register page and windows, for mmap()
+    resource_size_t phys_size;
+
+    // /dev/mulmatr_core (first instance) or /dev/mulmatr_core<index>
+    int index;                      // Minor, slot in vm_devs
+    struct cdev *cdev;              // Freed by its last open file, not with the instance
+    atomic_t load;                  // Open files plus balanced jobs running, for /dev/mulmatr
+    struct kref ref;                // The bound device, each open file and each balanced job
+    bool gone;                      // Removed, under 'lock': nothing touches the device anymore
+
+    // End of operation interrupts, read(), poll() and the driver itself wait for them
+    atomic_t op_events;
+    wait_queue_head_t op_wait;
+    spinlock_t event_lock;          // Protects run_*, op_armed and mmap_owner against the IRQ handler
+    struct eventfd_ctx *run_eventfd; // eventfd of the file whose operation is running
+    struct vm_file *run_file;       // File the end of the running operation is counted for
+    bool op_armed;                  // The driver started an operation, its end is an event
+
+    struct vm_pool pool;            // Staging memory shared by the contexts and the transfers
+
+    // Limits and window offsets read from the capability registers
+    u32 max_size;
+    u32 matra_off;
+    u32 matrb_off;
+    u32 matrc_off;
+
+    // Coherent staging buffers used in DMA mode (NULL if unavailable)
+    u32 *dma_a;
+    u32 *dma_b;
+    u32 *dma_c;
+    dma_addr_t dma_handle;
+
+    // Coherent buffer holding B and C of a GEMM, grown on demand
+    u32 *gemm_buf;
+    size_t gemm_len;        // Words available for each of B and C
+    dma_addr_t gemm_handle;
+
+    // Coherent buffer holding the row pointers, column indexes and values of a sparse A
+    u32 *csr_buf;
+    size_t csr_words;
+    dma_addr_t csr_handle;
+
+    // Submission/completion queues (NULL if DMA is unavailable)
+    struct vm_sqe *sq;
+    struct vm_cqe *cq;
+    dma_addr_t q_handle;
+    u32 sq_tail;
+    u32 cq_head;
+    u32 cq_phase;
+    u32 inflight;
+    struct vm_qentry qents[Q_ENTRIES];
+    struct mutex lock;              // Serializes the dispatcher and the GEMM, batch and slot ioctls
+    wait_queue_head_t cq_wait;      // Woken by the batch IRQ
+    int irq;                        // 0 if no IRQ line, the CQ is polled
+
+    // Matrices resident in the device
+    u32 num_slots;
+    struct vm_mslot mslots[MAX_SLOTS];
+    u64 slot_clock;                 // Orders the slots by last use
+
+    // Dispatcher, under 'lock': which file the device is working for and what it holds
+    struct vm_file *running;        // File whose CTRL_START_OP operation is in the device
+    bool orphaned;                  // An operation timed out and may still be running
+    u32 run_size;
+    u32 run_events;                 // op_events when it was started
+    struct vm_file *a_owner;        // File whose A, B and C are in the device, NULL if none
+    struct vm_file *b_owner;
+    struct vm_file *c_owner;
+    struct vm_file *submit_owner;   // File whose MULMATR_SUBMIT left A in the device
+    struct vm_file *mmap_owner;     // File that mapped the device, no other file can be open
+    struct address_space *mmap_mapping; // Where its mapping lives, zapped on remove
+    u32 users;                      // Open files
+    bool hw_valid;                  // The registers below hold the last values written
+    u32 hw_ctrl;
+    u32 hw_size;
+    s32 hw_alpha;
+    s32 hw_beta;
 };
 
-static int major;
-static long base_address;
+// Control bits of a file that the dispatcher writes in the device, it manages the others itself
+#define VM_CTX_HW_CTRL      (CTRL_FMT_MASK | BIT_C_ACCUM)
+
+/*
+ * State of an open device node: a job context of its own. The register
+ * flow ioctls only change the context, CTRL_START_OP hands it to the
+ * dispatcher, which loads in the device what differs from the last operation
+ * and collects C into the context when the next one needs the device.
+ */
+struct vm_file {
+    struct virt_mulmatr *vm;
+    atomic_t op_events;     // Ends of the operations of this file, or of its mapping
+    u32 events_seen;        // op_events at the last read()
+    struct mutex lock;      // Serializes the ioctls of this file
 
-enum {
-    CDEV_NOT_USED = 0,
-    CDEV_EXCLUSIVE_OPEN = 1,
+    u32 ctrl;               // BIT_C_ENABLE, BIT_C_END_OP_IRQ_EN, CTRL_FMT_MASK and BIT_C_ACCUM
+    u32 size;
+    s32 alpha;
+    s32 beta;
+    u32 *a;                 // size x size, one element per word
+    u32 *b;                 // size
+    u32 *c;                 // size, the last result; written by the dispatcher under vm->lock
+    u32 cap;                // Size the buffers have room for
+    bool a_dirty;           // Changed since the dispatcher loaded it
+    bool b_dirty;
+    u32 status;             // Status of the last operation, under vm->lock
+    struct eventfd_ctx *op_eventfd; // Registered with MULMATR_SET_EVENTFD, signalled if BIT_C_END_OP_IRQ_EN
+    bool balanced;          // Opened through /dev/mulmatr, 'vm' was picked by load
 };
 
-static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED);  // Track if device is currently open
-static struct class *cls;                              
+static dev_t vm_devt;                           // First of VM_MAX_DEVICES + 1 minors
+static struct class *vm_class;
+static struct cdev vm_lb_cdev;                  // /dev/mulmatr
+static DEFINE_MUTEX(vm_devs_lock);              // Protects vm_devs
+static struct virt_mulmatr *vm_devs[VM_MAX_DEVICES];
+static atomic_t vm_lb_next;                     // Where the next search for the least loaded starts
+
+// The balancing node can be left out, each instance keeps its own node anyway
+static bool lb_node = true;
+module_param(lb_node, bool, 0444);
+MODULE_PARM_DESC(lb_node, "Create /dev/mulmatr, spreading files and jobs over the instances (default: on)");
+
+// The register page can be mapped only when asked for, the windows always can
+static bool mmap_regs;
+module_param(mmap_regs, bool, 0444);
+MODULE_PARM_DESC(mmap_regs, "Allow mmap() of the register page (default: windows only)");
 
 // File operations structure, specifying functions for file operations
 static struct file_operations dev_fops = {
     .open =  device_open,
     .release = device_release,
     .unlocked_ioctl = device_ioctl,
+    .read = device_read,
+    .poll = device_poll,
+    .mmap = device_mmap,
 };
 
 // Function to handle opening the device file
 static int device_open(struct inode *inode, struct file *file)
 {
-    // Ensure device is not already open; returns -EBUSY if in use
-    if (atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN))
-        return -EBUSY;
+    bool balanced = iminor(inode) == VM_LB_MINOR;
+    struct virt_mulmatr *vm;
+    struct vm_file *vf;
+    int ret;
+
+    // The balancing node binds the file to the instance with the least load
+    vm = balanced ? vm_lb_pick() : vm_get(iminor(inode));
+    if (IS_ERR_OR_NULL(vm))
+        return vm ? PTR_ERR(vm) : -ENODEV;
+
+    vf = kzalloc(sizeof(*vf), GFP_KERNEL);
+    if (!vf) {
+        vm_put(vm);
+        return -ENOMEM;
+    }
+
+    // Every file starts from the reset values of the registers
+    vf->vm = vm;
+    vf->balanced = balanced;
+    mutex_init(&vf->lock);
+    vf->ctrl = DEFAULT_CTRL_REG;
+    vf->size = min_t(u32, DEFAULT_SIZE_REG, vm->max_size);
+    vf->alpha = 1;
+    vf->beta = 1;
+    vf->a_dirty = true;
+    vf->b_dirty = true;
+    ret = vm_ctx_reserve(vf, vf->size);
+    if (ret)
+        goto err;
+
+    // A file that mapped the device programs it behind the dispatcher, it stays alone
+    mutex_lock(&vm->lock);
+    if (vm->gone || vm->mmap_owner) {
+        ret = vm->gone ? -ENODEV : -EBUSY;
+        mutex_unlock(&vm->lock);
+        goto err;
+    }
+    vm->users++;
+    mutex_unlock(&vm->lock);
+
+    file->private_data = vf;
 
     try_module_get(THIS_MODULE);
-    printk(KERN_DEBUG "KERNEL mmc: Open executed\n");
-    pr_info("KERNEL mmc: Open executed\n");
+    pr_debug("KERNEL mmc: Open executed\n");
     return 0;
+
+err:
+    vm_ctx_free(vf);
+    kfree(vf);
+    vm_put(vm);
+    return ret;
 }
 
 // Function to handle closing the device file
 static int device_release(struct inode *inode, struct file *file)
 {
-    atomic_set(&already_open, CDEV_NOT_USED); // Reset device open state
-    
+    struct vm_file *vf = file->private_data;
+    struct virt_mulmatr *vm = vf->vm;
+    bool last;
+
+    mutex_lock(&vm->lock);
+    // The result is not wanted anymore, but the device must be done with the operands
+    if (vm->running == vf)
+        vm_ctx_retire(vm);
+    // The slots of the file go with it; freeing them reprograms the device
+    if (vm_slot_release(vm, vf)) {
+        vm->hw_valid = false;
+        vm->a_owner = vm->b_owner = vm->c_owner = NULL;
+        vm->submit_owner = NULL;
+    }
+    if (vm->a_owner == vf)
+        vm->a_owner = NULL;
+    if (vm->b_owner == vf)
+        vm->b_owner = NULL;
+    if (vm->c_owner == vf)
+        vm->c_owner = NULL;
+    if (vm->submit_owner == vf)
+        vm->submit_owner = NULL;
+    if (vm->mmap_owner == vf) {
+        // Nothing is known about what the mapping left in the registers
+        spin_lock_irq(&vm->event_lock);
+        vm->mmap_owner = NULL;
+        spin_unlock_irq(&vm->event_lock);
+        vm->hw_valid = false;
+        vm->a_owner = vm->b_owner = vm->c_owner = NULL;
+    }
+    last = !--vm->users;
+    mutex_unlock(&vm->lock);
+
+    vm_set_eventfd(vf, -1);
+    vm_ctx_free(vf);
+    kfree(vf);
+    // The big staging buffers of a finished job are not worth keeping for the next open
+    if (last)
+        vm_pool_trim(vm);
+    vm_put(vm);
+
     module_put(THIS_MODULE); 
-    printk(KERN_DEBUG "KERNEL mmc: Release executed\n\n");
-    pr_info("KERNEL mmc: Release executed\n");
+    pr_debug("KERNEL mmc: Release executed\n\n");
+    return 0;
+}
+
+// Like UIO: read() returns the number of end of operation interrupts as a u32,
+// sleeping until one arrives that this file has not reported yet
+static ssize_t device_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct vm_file *vf = file->private_data;
+    struct virt_mulmatr *vm = vf->vm;
+    u32 events;
+    int ret;
+
+    if (count != sizeof(u32))
+        return -EINVAL;
+
+    if (!vm->irq)
+        return -EIO;    // Nothing would ever wake us
+
+    if (file->f_flags & O_NONBLOCK) {
+        if (atomic_read(&vf->op_events) == vf->events_seen && !READ_ONCE(vm->gone))
+            return -EAGAIN;
+    } else {
+        ret = wait_event_interruptible(vm->op_wait,
+                                       atomic_read(&vf->op_events) != vf->events_seen ||
+                                       READ_ONCE(vm->gone));
+        if (ret)
+            return ret;
+    }
+    if (READ_ONCE(vm->gone))
+        return -ENODEV;
+
+    events = atomic_read(&vf->op_events);
+    if (copy_to_user(buf, &events, sizeof(events)))
+        return -EFAULT;
+    vf->events_seen = events;
+    return sizeof(events);
+}
+
+static __poll_t device_poll(struct file *file, struct poll_table_struct *wait)
+{
+    struct vm_file *vf = file->private_data;
+    struct virt_mulmatr *vm = vf->vm;
+
+    if (!vm->irq)
+        return EPOLLERR;
+
+    poll_wait(file, &vm->op_wait, wait);
+    if (READ_ONCE(vm->gone))
+        return EPOLLERR | EPOLLHUP;
+    if (atomic_read(&vf->op_events) != vf->events_seen)
+        return EPOLLIN | EPOLLRDNORM;
     return 0;
 }
 
+// Map the device, the file offset is the offset in the register space: the
+// windows start at CAP_MATRA_OFF_REG, page 0 holds the registers (and the
+// windows of devices with the legacy layout). The mapping bypasses the job
+// contexts, so it is allowed only to the single open file of the device.
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct vm_file *vf = file->private_data;
+    struct virt_mulmatr *vm = vf->vm;
+    int ret = -EBUSY;
+
+    if (vma->vm_pgoff == 0 && !mmap_regs)
+        return -EPERM;
+
+    mutex_lock(&vm->lock);
+    if (vm->gone) {
+        ret = -ENODEV;
+    } else if (vm->users == 1) {
+        if (vm->running == vf)
+            vm_ctx_retire(vm);
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+        ret = vm_iomap_memory(vma, vm->phys, vm->phys_size);
+        // Claimed only by a mapping that exists
+        if (!ret) {
+            spin_lock_irq(&vm->event_lock);
+            vm->mmap_owner = vf;
+            spin_unlock_irq(&vm->event_lock);
+            vm->mmap_mapping = file->f_mapping;
+        }
+    }
+    mutex_unlock(&vm->lock);
+    return ret;
+}
+
 // IOCTL handler function to process custom commands sent to device
 static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
+    struct vm_file *vf = file->private_data;
+    long ret;
+
+    // Jobs that need nothing of the context run on whichever instance is least loaded
+    if (vf->balanced) {
+        ret = vm_lb_ioctl(vf, cmd, arg);
+        if (ret != -ENOIOCTLCMD)
+            return ret;
+    }
+
+    // The context of a file is used by one ioctl at a time
+    mutex_lock(&vf->lock);
+    ret = vm_ioctl(vf, cmd, arg);
+    mutex_unlock(&vf->lock);
+    return ret;
+}
+
+// Instance with the least load, ties go round robin; the caller owns one unit of its
+// load and a reference, both dropped by vm_put(). Mapped instances are left to their
+// mapping: -EBUSY if only those are left, -ENODEV if there is none at all
+static struct virt_mulmatr *vm_lb_pick(void)
+{
+    unsigned int start = atomic_inc_return(&vm_lb_next);
+    struct virt_mulmatr *best = NULL;
+    struct virt_mulmatr *vm;
+    int ret = -ENODEV;
+    int i;
+
+    mutex_lock(&vm_devs_lock);
+    for (i = 0; i < VM_MAX_DEVICES; i++) {
+        vm = vm_devs[(start + i) % VM_MAX_DEVICES];
+        if (!vm)
+            continue;
+        // Only a hint, vm_dev_lock() has the last word
+        if (READ_ONCE(vm->mmap_owner)) {
+            ret = -EBUSY;
+            continue;
+        }
+        if (!best || atomic_read(&vm->load) < atomic_read(&best->load))
+            best = vm;
+    }
+    if (best) {
+        atomic_inc(&best->load);
+        kref_get(&best->ref);
+    }
+    mutex_unlock(&vm_devs_lock);
+    return best ? best : ERR_PTR(ret);
+}
+
+// Instance behind a /dev/mulmatr_core minor, NULL once removed; held like vm_lb_pick()
+static struct virt_mulmatr *vm_get(unsigned int index)
+{
+    struct virt_mulmatr *vm = NULL;
+
+    mutex_lock(&vm_devs_lock);
+    if (index < VM_MAX_DEVICES)
+        vm = vm_devs[index];
+    if (vm) {
+        atomic_inc(&vm->load);
+        kref_get(&vm->ref);
+    }
+    mutex_unlock(&vm_devs_lock);
+    return vm;
+}
+
+static void vm_release(struct kref *ref)
+{
+    struct virt_mulmatr *vm = container_of(ref, struct virt_mulmatr, ref);
+
+    vm_pool_fini(vm);
+    kfree(vm);
+}
+
+static void vm_put(struct virt_mulmatr *vm)
+{
+    atomic_dec(&vm->load);
+    kref_put(&vm->ref, vm_release);
+}
+
+// GEMMs and sparse GEMMs of a /dev/mulmatr file, -ENOIOCTLCMD for the commands
+// that belong to the instance the file is bound to
+static long vm_lb_ioctl(struct vm_file *vf, unsigned int cmd, unsigned long arg)
+{
+    struct mulmatr_gemm req;
+    struct virt_mulmatr *vm;
+    long ret;
+
+    if (cmd != MULMATR_GEMM && cmd != MULMATR_CSR)
+        return -ENOIOCTLCMD;
+
+    // Read once: where the job runs and what it runs are decided on the same copy
+    if (cmd == MULMATR_GEMM) {
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+        // Handles only exist in the instance that loaded them
+        if (req.slot)
+            return vm_gemm(vf->vm, vf, &req);
+    }
+
+    vm = vm_lb_pick();
+    if (IS_ERR(vm))
+        return PTR_ERR(vm);
+
+    pr_debug("KERNEL mmc: balanced job on instance %d\n", vm->index);
+    if (cmd == MULMATR_GEMM)
+        ret = vm_gemm(vm, vf, &req);
+    else
+        ret = vm_csr(vm, vf, (struct mulmatr_csr __user *)arg);
+
+    vm_put(vm);
+    return ret;
+}
+
+// Commands of one file, with its lock held
+static long vm_ioctl(struct vm_file *vf, unsigned int cmd, unsigned long arg)
+{
+    struct virt_mulmatr *vm = vf->vm;
+    struct mulmatr_gemm gemm;
     u32 val;
-    u32 *p_vals;
     u32 size;
-    int i;
-    long reg_base;
+    u32 per_word;
+    int ret;
     
     switch(cmd) {
 
             case RD_ID:
                 // Read device ID from ID_REG
-                printk(KERN_DEBUG "KERNEL mmc: ioctl RD_ID data\n");
-                pr_info("KERNEL mmc: ioctl RD_ID data\n");
-                val = (u32)readl_relaxed(base_address + ID_REG);        // Read the device ID
+                pr_debug("KERNEL mmc: ioctl RD_ID data\n");
+                mutex_lock(&vm->lock);
+                val = vm->gone ? 0 : (u32)readl_relaxed(vm->base + ID_REG); // Read the device ID
+                mutex_unlock(&vm->lock);
                 // Copy the device ID value to user space
                 if( copy_to_user((int32_t*) arg, &val, sizeof(val)) )
                 {
                     // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_to_user ERR!\n");
                     pr_err("KERNEL mmc: copy_to_user ERR!\n");
                 }
                 break;
 
             case RD_STATUS:
-                // Read current device status from STATUS_REG
-                printk(KERN_DEBUG "KERNEL mmc: ioctl RD_SIZE data\n");
-                pr_info("KERNEL mmc: ioctl RD_SIZE data\n");
-                val = (u32)readl_relaxed(base_address + STATUS_REG);    // Read the status
+                // Read the status of the last operation of this file
+                pr_debug("KERNEL mmc: ioctl RD_STATUS data\n");
+                mutex_lock(&vm->lock);
+                if (vm->running == vf) {
+                    val = (u32)readl_relaxed(vm->base + STATUS_REG);  // Read the status
+                    // Ended: collect C now, the device is free for the other files
+                    if (val & BIT_S_OP_ENDED)
+                        vm_ctx_retire(vm);
+                }
+                val = vf->status;
+                mutex_unlock(&vm->lock);
                 // Copy the status value to user space
                 if( copy_to_user((int32_t*) arg, &val, sizeof(val)) )
                 {   
                     // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_to_user ERR!\n");
                     pr_err("KERNEL mmc: copy_to_user ERR!\n");
                 }
                 break;
 
             case CTRL_ENABLE_DEV:
-                // Enable device by setting BIT_C_ENABLE in CONTROL_REG
-                printk(KERN_DEBUG "KERNEL mmc: ioctl CTRL_ENABLE_DEV data\n");
-                pr_info("KERNEL mmc: ioctl CTRL_ENABLE_DEV data\n");
-                val = (u32)readl_relaxed(base_address + CONTROL_REG);   // Read control register
-                val = val | BIT_C_ENABLE;                               // Set enable bit
-                writel_relaxed(val, base_address + CONTROL_REG);        // Write updated value to control register
+                // Enable device by setting BIT_C_ENABLE in the control register of this file
+                pr_debug("KERNEL mmc: ioctl CTRL_ENABLE_DEV data\n");
+                vf->ctrl |= BIT_C_ENABLE;                               // Set enable bit
                 break;
 
             case CTRL_DISABLE_DEV:
-                // Disable device by clearing BIT_C_ENABLE in CONTROL_REG
-                printk(KERN_DEBUG "KERNEL mmc: ioctl CTRL_DISABLE_DEV data\n");
-                pr_info("KERNEL mmc: ioctl CTRL_DISABLE_DEV data\n");
-                val = (u32)readl_relaxed(base_address + CONTROL_REG);   // Read control register
-                val = val & (~BIT_C_ENABLE);                            // Clear enable bit
-                writel_relaxed(val, base_address + CONTROL_REG);        // Write updated value to control register
+                // Disable device by clearing BIT_C_ENABLE in the control register of this file
+                pr_debug("KERNEL mmc: ioctl CTRL_DISABLE_DEV data\n");
+                vf->ctrl &= ~BIT_C_ENABLE;                              // Clear enable bit
                 break;
 
             case CTRL_ENABLE_IRQ:
-                // Enable interrupts by setting the BIT_C_END_OP_IRQ_EN in the CONTROL_REG
-                printk(KERN_DEBUG "KERNEL mmc: ioctl CTRL_ENABLE_IRQ data\n");
-                pr_info("KERNEL mmc: ioctl CTRL_ENABLE_IRQ data\n");
-                val = (u32)readl_relaxed(base_address + CONTROL_REG);   // Read control register
-                val = val | BIT_C_END_OP_IRQ_EN;                        // Set interrupt enable bit
-                writel_relaxed(val, base_address + CONTROL_REG);        // Write updated value to control register
+                // Enable interrupts by setting the BIT_C_END_OP_IRQ_EN in the control register of this file
+                pr_debug("KERNEL mmc: ioctl CTRL_ENABLE_IRQ data\n");
+                vf->ctrl |= BIT_C_END_OP_IRQ_EN;                        // Set interrupt enable bit
                 break;
 
             case CTRL_DISABLE_IRQ:
-                // Disable interrupts by clearing the BIT_C_END_OP_IRQ_EN in the CONTROL_REG
-                printk(KERN_DEBUG "KERNEL mmc: ioctl CTRL_DISABLE_IRQ data\n");
-                pr_info("KERNEL mmc: ioctl CTRL_DISABLE_IRQ data\n");
-                val = (u32)readl_relaxed(base_address + CONTROL_REG);   // Read control register
-                val = val & (~BIT_C_END_OP_IRQ_EN);                     // Clear interrupt enable bit
-                writel_relaxed(val, base_address + CONTROL_REG);        // Write updated value to control register
+                // Disable interrupts by clearing the BIT_C_END_OP_IRQ_EN in the control register of this file
+                pr_debug("KERNEL mmc: ioctl CTRL_DISABLE_IRQ data\n");
+                vf->ctrl &= ~BIT_C_END_OP_IRQ_EN;                       // Clear interrupt enable bit
                 break;
 
             case CTRL_START_OP:
-                // Start the operation by setting the BIT_C_START_OP in the CONTROL_REG
-                printk(KERN_DEBUG "KERNEL mmc: ioctl CTRL_START_OP data\n");
-                pr_info("KERNEL mmc: ioctl CTRL_START_OP data\n");
-                val = (u32)readl_relaxed(base_address + CONTROL_REG);   // Read control register
-                val = val | BIT_C_START_OP;                             // Set the start operation bit
-                writel_relaxed(val, base_address + CONTROL_REG);        // Write updated value to control register
+                // Hand the context to the dispatcher, it starts the operation and returns
+                pr_debug("KERNEL mmc: ioctl CTRL_START_OP data\n");
+                return vm_ctx_start(vf);
+
+            case MULMATR_WAIT:
+                // Sleep until the operation started by CTRL_START_OP ends, then return the status
+                pr_debug("KERNEL mmc: ioctl MULMATR_WAIT data\n");
+                ret = 0;
+                mutex_lock(&vm->lock);
+                if (vm->running == vf)
+                    ret = vm_ctx_retire(vm);
+                val = vf->status;
+                mutex_unlock(&vm->lock);
+                // Device errors are reported in the status, only a lost operation fails
+                if (ret == -ETIMEDOUT)
+                    return ret;
+                if (copy_to_user((u32 __user *)arg, &val, sizeof(val)))
+                    return -EFAULT;
                 break;
 
+            case MULMATR_SET_EVENTFD:
+                // Register the eventfd signalled when an operation of this file ends
+                pr_debug("KERNEL mmc: ioctl MULMATR_SET_EVENTFD data\n");
+                if (get_user(val, (u32 __user *)arg))
+                    return -EFAULT;
+                return vm_set_eventfd(vf, (s32)val);
+
             case CTRL_RESET_STAT:
-                // Reset the status by setting the BIT_C_RESET_STAT in the CONTROL_REG
-                printk(KERN_DEBUG "KERNEL mmc: ioctl CTRL_RESET_STAT data\n");
-                pr_info("KERNEL mmc: ioctl CTRL_RESET_STAT data\n");
-                val = (u32)readl_relaxed(base_address + CONTROL_REG);   // Read control register
-                val = val | BIT_C_RESET_STAT;                           // Set the reset status bit
-                writel_relaxed(val, base_address + CONTROL_REG);        // Write updated value to control register
+                // Reset the status of this file, a running operation stays started
+                pr_debug("KERNEL mmc: ioctl CTRL_RESET_STAT data\n");
+                mutex_lock(&vm->lock);
+                vf->status &= BIT_S_OP_STARTED;
+                mutex_unlock(&vm->lock);
+                break;
+
+            case RD_COUNTERS:
+                // Read the performance counters, all in one copy
+                pr_debug("KERNEL mmc: ioctl RD_COUNTERS data\n");
+                {
+                    struct mulmatr_counters cnt;
+
+                    mutex_lock(&vm->lock);
+                    if (vm->gone) {
+                        mutex_unlock(&vm->lock);
+                        return -ENODEV;
+                    }
+                    vm_read_counters(vm, &cnt);
+                    mutex_unlock(&vm->lock);
+                    if (copy_to_user((void __user *)arg, &cnt, sizeof(cnt)))
+                        return -EFAULT;
+                }
+                break;
+
+            case CTRL_RESET_CNT:
+                // Zero the performance counters by setting BIT_C_CNT_RESET in the CONTROL_REG
+                pr_debug("KERNEL mmc: ioctl CTRL_RESET_CNT data\n");
+                mutex_lock(&vm->lock);
+                if (vm->gone) {
+                    mutex_unlock(&vm->lock);
+                    return -ENODEV;
+                }
+                val = (u32)readl_relaxed(vm->base + CONTROL_REG);      // Read control register
+                val = val | BIT_C_CNT_RESET;                            // Set the counter reset bit
+                writel_relaxed(val, vm->base + CONTROL_REG);            // Write updated value to control register
+                mutex_unlock(&vm->lock);
+                break;
+
+            case WR_FORMAT:
+                // Select the element format of A and B of this file
+                pr_debug("KERNEL mmc: ioctl WR_FORMAT data\n");
+                if(copy_from_user(&val ,(int32_t*) arg, sizeof(val)) )
+                {
+                    pr_err("KERNEL mmc: copy_from_user ERR!\n");
+                    return -EFAULT;
+                }
+                if(val > CTRL_FMT_INT8)
+                    return -EINVAL;
+                vf->ctrl = (vf->ctrl & ~CTRL_FMT_MASK) | (val << CTRL_FMT_SHIFT);
+                // A and B are packed again in the new format when they are loaded
+                vf->a_dirty = true;
+                vf->b_dirty = true;
+                break;
+
+            case CTRL_ACCUM:
+                // Set or clear BIT_C_ACCUM for this file and keep the scales
+                pr_debug("KERNEL mmc: ioctl CTRL_ACCUM data\n");
+                {
+                    struct mulmatr_accum acc;
+
+                    if(copy_from_user(&acc, (struct mulmatr_accum __user *) arg, sizeof(acc)) )
+                    {
+                        pr_err("KERNEL mmc: copy_from_user ERR!\n");
+                        return -EFAULT;
+                    }
+                    vf->alpha = acc.alpha;
+                    vf->beta = acc.beta;
+                    vf->ctrl = acc.enable ? (vf->ctrl | BIT_C_ACCUM) : (vf->ctrl & ~BIT_C_ACCUM);
+                }
                 break;
 
             case RD_SIZE:
-                // Read the size of the matrix from the SIZE_REG register
-                printk(KERN_DEBUG "KERNEL mmc: ioctl RD_SIZE data\n");
-                pr_info("KERNEL mmc: ioctl RD_SIZE data\n");
-                val = (u32)readl_relaxed(base_address + SIZE_REG);      // Read size value
+                // Read the size of the matrices of this file
+                pr_debug("KERNEL mmc: ioctl RD_SIZE data\n");
+                val = vf->size;
                 // Copy the size value to user space
                 if( copy_to_user((int32_t*) arg, &val, sizeof(val)) )
                 {
                     // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_to_user ERR!\n");
                     pr_err("KERNEL mmc: copy_to_user ERR!\n");
                 }
                 break;
 
             case WR_SIZE:
-                // Write a new size value to the SIZE_REG register
-                printk(KERN_DEBUG "KERNEL mmc: ioctl WR_SIZE data\n");
-                pr_info("KERNEL mmc: ioctl RD_SIZE data\n");
+                // Write a new size value in the context of this file
+                pr_debug("KERNEL mmc: ioctl WR_SIZE data\n");
                 // Copy the new size value from user space
                 if(copy_from_user(&val ,(int32_t*) arg, sizeof(val)) )
                 {
                     // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_from_user ERR!\n");
                     pr_err("KERNEL mmc: copy_from_user ERR!\n");
                 }
                 else
                 {
                     // Check if the new size is within limits
-                    if(val > MAX_SIZE)
+                    if(val > vm->max_size)
                     {
                         // Log error if too large size
-                        printk(KERN_DEBUG "KERNEL mmc: tryng to write %d on size, too big, ERR!\n", val);
-                        pr_info("KERNEL mmc: tryng to write %d on size, too big, ERR!\n", val);
+                        pr_err("KERNEL mmc: tryng to write %d on size, too big, ERR!\n", val);
                     }
                     else
-                        writel_relaxed(val, base_address + SIZE_REG);   // Write the new size to SIZE_REG
+                    {
+                        // The dispatcher may be writing C of this file, grow the buffers under its lock
+                        mutex_lock(&vm->lock);
+                        ret = vm_ctx_reserve(vf, val);
+                        mutex_unlock(&vm->lock);
+                        if (ret)
+                            return ret;
+                        vf->size = val;
+                        vf->a_dirty = true;
+                        vf->b_dirty = true;
+                    }
                 }
                 break;
 
             case RD_MATRA:
-                // Read data from matrix A
-                printk(KERN_DEBUG "KERNEL mmc: ioctl RD_MATRA data\n");
-                pr_info("KERNEL mmc: ioctl RD_MATRA data\n");
-                size = (u32)readl_relaxed(base_address + SIZE_REG);     // Read the size
-                size = size*size;   // Calculate total number of elements in the square matrix A
-
-                // Memory allocation for the matrix A
-                p_vals = kmalloc(sizeof(u32)*size, GFP_KERNEL);
-                if (!p_vals) {
-                    // Log error if allocation fails
-                    printk(KERN_ERR "KERNEL mmc: Error allocating dynamic mem\n");
-                    pr_info("KERNEL mmc: Error allocating dynamic mem\n");
-                    return -EFAULT;
-                }
+                // Read data from matrix A of this file
+                pr_debug("KERNEL mmc: ioctl RD_MATRA data\n");
+                size = vf->size*vf->size;   // Calculate total number of elements in the square matrix A
 
-                reg_base = base_address + MATR_A_START;     // Calculate base address for matrix A
-                // Read each element of matrix A
-                for (i = 0; i < size; i++) 
-                    p_vals[i] = readl_relaxed(reg_base + (i * 4));  
-                
                  // Copy the matrix data to user space
-                if(copy_to_user((int32_t*) arg, p_vals, sizeof(u32) * size))
-                {   
-                    // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_to_user ERR!\n");
+                if(copy_to_user((int32_t*) arg, vf->a, sizeof(u32) * size))
+                {
                     pr_err("KERNEL mmc: copy_to_user ERR!\n");
+                    return -EFAULT;
                 }
-                kfree(p_vals);      // Free the allocated memory
                 break;
 
             case WR_MATRA:
-                // Write data to matrix A
-                printk(KERN_DEBUG "KERNEL mmc: ioctl WR_MATRA data\n");
-                pr_info("KERNEL mmc: ioctl WR_MATRA data\n");
-                
-                size = (int)readl_relaxed(base_address + SIZE_REG);     // Read the size
-                size = size*size;       // Calculate total number of elements in the square matrix A
-                
-                // Memory allocation for the matrix A
-                p_vals = kmalloc(sizeof(u32)*size, GFP_KERNEL);
-                if (!p_vals) {
-                    // Log error if allocation fails
-                    printk(KERN_ERR "KERNEL mmc: Error allocating dynamic mem\n");
-                    pr_info("KERNEL mmc: Error allocating dynamic mem\n");
-                    return -EFAULT;
-                }
+                // Write data to matrix A of this file, the dispatcher loads it at the next start
+                pr_debug("KERNEL mmc: ioctl WR_MATRA data\n");
+                size = vf->size*vf->size;       // Calculate total number of elements in the square matrix A
+                per_word = vm_fmt_per_word(vf->ctrl);  // Packed elements per word
 
+                vf->a_dirty = true;
                 // Copy the new matrix from user space
-                if(copy_from_user(p_vals, (int32_t*) arg, sizeof(u32) * size))
+                if(copy_from_user(vf->a, (int32_t*) arg, sizeof(u32) * size))
                 {
-                    // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_from_user ERR!\n");
                     pr_err("KERNEL mmc: copy_from_user ERR!\n");
+                    return -EFAULT;
                 }
-                else
-                {
-                    reg_base = base_address + MATR_A_START;     // Calculate base address for matrix A
-                    // Write each element of matrix A
-                    for (i = 0; i < size; i++) 
-                        writel_relaxed(p_vals[i], reg_base + (i * 4));
-                }
-
-                kfree(p_vals);      // Free the allocated memory
+                // Keep what the device will see, RD_MATRA returns the values truncated to the format
+                vm_pack(vf->a, size, per_word);
+                vm_unpack(vf->a, size, per_word);
                 break;
 
             case RD_MATRB:
-                // Read data from matrix B
-                printk(KERN_DEBUG "KERNEL mmc: ioctl RD_MATRB data\n");
-                pr_info("KERNEL mmc: ioctl RD_MATRB data\n");
-                size = (u32)readl_relaxed(base_address + SIZE_REG);     // Read the size
-                size = size;  // Flat matrix
-
-                // Memory allocation for the matrix B
-                p_vals = kmalloc(sizeof(u32)*size, GFP_KERNEL);
-                if (!p_vals) {
-                    // Log error if allocation fails
-                    printk(KERN_ERR "KERNEL mmc: Error allocating dynamic mem\n");
-                    pr_info("KERNEL mmc: Error allocating dynamic mem\n");
-                    return -EFAULT;
-                }
-
-                reg_base = base_address + MATR_B_START;     // Calculate base address for matrix B
-                // Read each element of matrix B
-                for (i = 0; i < size; i++) 
-                    p_vals[i] = readl_relaxed(reg_base + (i * 4));
+                // Read data from matrix B of this file
+                pr_debug("KERNEL mmc: ioctl RD_MATRB data\n");
+                size = vf->size;  // Flat matrix
 
                 // Copy the matrix data to user space
-                if(copy_to_user((int32_t*) arg, p_vals, sizeof(u32) * size))
+                if(copy_to_user((int32_t*) arg, vf->b, sizeof(u32) * size))
                 {
-                    // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_from_user ERR!\n");
-                    pr_err("KERNEL mmc: copy_from_user ERR!\n");
+                    pr_err("KERNEL mmc: copy_to_user ERR!\n");
+                    return -EFAULT;
                 }
-
-                kfree(p_vals);      // Free the allocated memory
                 break;
                 
             case WR_MATRB:
-                // Write data to matrix B
-                printk(KERN_DEBUG "KERNEL mmc: ioctl WR_MATRB data\n");
-                pr_info("KERNEL mmc: ioctl WR_MATRB data\n");
-                size = (u32)readl_relaxed(base_address + SIZE_REG);     // Read the size
-                size = size;    // Flat matrix
-
-                // Memory allocation for the matrix B
-                p_vals = kmalloc(sizeof(u32)*size, GFP_KERNEL);
-                if (!p_vals) {
-                    // Log error if allocation fails
-                    printk(KERN_ERR "KERNEL mmc: Error allocating dynamic mem\n");
-                    pr_info("KERNEL mmc: Error allocating dynamic mem\n");
-                    return -EFAULT;
-                }
+                // Write data to matrix B of this file, the dispatcher loads it at the next start
+                pr_debug("KERNEL mmc: ioctl WR_MATRB data\n");
+                size = vf->size;    // Flat matrix
+                per_word = vm_fmt_per_word(vf->ctrl);  // Packed elements per word
 
+                vf->b_dirty = true;
                 // Copy the new matrix from user space
-                if(copy_from_user(p_vals, (int32_t*) arg, sizeof(u32) * size))
+                if(copy_from_user(vf->b, (int32_t*) arg, sizeof(u32) * size))
                 {
-                    // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_from_user ERR!\n");
                     pr_err("KERNEL mmc: copy_from_user ERR!\n");
+                    return -EFAULT;
                 }
-                else
-                {
-                    reg_base = base_address + MATR_B_START;     // Calculate base address for matrix B
-                    // Write each element of matrix B
-                    for (i = 0; i < size; i++) 
-                        writel_relaxed(p_vals[i], reg_base + (i * 4));
-                }
-                kfree(p_vals);      // Free the allocated memory
+                vm_pack(vf->b, size, per_word);
+                vm_unpack(vf->b, size, per_word);
                 break;
 
             case RD_MATRC:
-                // Read data from matrix C
-                printk(KERN_DEBUG "KERNEL mmc: ioctl RD_MATRC data\n");
-                pr_info("KERNEL mmc: ioctl RD_MATRC data\n");
-                size = (u32)readl_relaxed(base_address + SIZE_REG);     // Read the size
-                size = size;
-
-                // Memory allocation for the matrix C
-                p_vals = kmalloc(sizeof(u32)*size, GFP_KERNEL);
-                if (!p_vals) {
-                    // Log error if allocation fails
-                    printk(KERN_ERR "KERNEL mmc: Error allocating dynamic mem\n");
-                    pr_info("KERNEL mmc: Error allocating dynamic mem\n");
-                    return -EFAULT;
-                }
-
-                reg_base = base_address + MATR_C_START;     // Calculate base address for matrix C
-                // Read each element of matrix C
-                for (i = 0; i < size; i++) 
-                    p_vals[i] = readl_relaxed(reg_base + (i * 4));
-
-                // Copy the matrix data to user space
-                if(copy_to_user((int32_t*) arg, p_vals, sizeof(u32) * size))
+                // Read data from matrix C, collecting the result of this file if it is still in the device
+                pr_debug("KERNEL mmc: ioctl RD_MATRC data\n");
+                mutex_lock(&vm->lock);
+                if (vm->running == vf)
+                    vm_ctx_retire(vm);
+                mutex_unlock(&vm->lock);
+                size = vf->size;
+
+                // Only this file can start its context again, C does not change under the copy
+                if(copy_to_user((int32_t*) arg, vf->c, sizeof(u32) * size))
                 {
-                    // Log error if copy fails
-                    printk(KERN_ERR "KERNEL mmc: copy_to_user ERR!\n");
                     pr_err("KERNEL mmc: copy_to_user ERR!\n");
+                    return -EFAULT;
                 }
-                kfree(p_vals);      // Free the allocated memory
                 break;                       
 
+            case MULMATR_GEMM:
+                // Load A and B, run the GEMM and copy C back, all in one call
+                pr_debug("KERNEL mmc: ioctl MULMATR_GEMM data\n");
+                if (copy_from_user(&gemm, (struct mulmatr_gemm __user *)arg, sizeof(gemm)))
+                    return -EFAULT;
+                return vm_gemm(vm, vf, &gemm);
+
+            case MULMATR_SUBMIT:
+                // Load A and b, sleep until the end of operation IRQ and copy C back, all in one call
+                pr_debug("KERNEL mmc: ioctl MULMATR_SUBMIT data\n");
+                return vm_submit(vm, vf, (struct mulmatr_submit __user *)arg);
+
+            case MULMATR_CSR:
+                // Load a sparse A and B, run the product and copy C back, all in one call
+                pr_debug("KERNEL mmc: ioctl MULMATR_CSR data\n");
+                return vm_csr(vm, vf, (struct mulmatr_csr __user *)arg);
+
+            case MULMATR_BATCH:
+                // Stream the jobs through the queues, refilling them as completions arrive
+                pr_debug("KERNEL mmc: ioctl MULMATR_BATCH data\n");
+                return vm_batch(vm, vf, (struct mulmatr_batch __user *)arg);
+
+            case MULMATR_SLOT_LOAD:
+                // Upload A once, later jobs refer to it by handle
+                pr_debug("KERNEL mmc: ioctl MULMATR_SLOT_LOAD data\n");
+                return vm_slot_load(vm, vf, (struct mulmatr_slot __user *)arg);
+
+            case MULMATR_SLOT_PIN:
+                // Pin or unpin a loaded matrix
+                pr_debug("KERNEL mmc: ioctl MULMATR_SLOT_PIN data\n");
+                return vm_slot_pin(vm, vf, (struct mulmatr_slot __user *)arg);
+
+            case MULMATR_SLOT_FREE:
+                // Release a loaded matrix
+                pr_debug("KERNEL mmc: ioctl MULMATR_SLOT_FREE data\n");
+                if (get_user(val, (u32 __user *)arg))
+                    return -EFAULT;
+                return vm_slot_free(vm, vf, val);
+
             default:
             // Invalid IOCTL command
-                    printk(KERN_DEBUG "KERNEL mmc: Error calling IOCTL cmd function\n");
-                    pr_info("KERNEL mmc: Error calling IOCTL cmd function\n");
+                    pr_debug("KERNEL mmc: Error calling IOCTL cmd function\n");
                     break;
     }
     return 0;
 
 }
 
-// Initialize the device
-static void vm_init(struct virt_mulmatr *vm)
+// Read every counter, HI is read again in case LO wrapped in between
+static void vm_read_counters(struct virt_mulmatr *vm, struct mulmatr_counters *cnt)
 {
-    // Register the character device with the system, requesting a dynamic major number
-    major = register_chrdev(0, DEVICE_NAME, &dev_fops);
+    __u64 *out = (__u64 *)cnt;
+    int i;
 
-    printk(KERN_DEBUG "KERNEL mmc: vm_init\n");
-    pr_info("KERNEL mmc: vm_init\n");
+    for (i = 0; i < CNT_NUM; i++) {
+        void __iomem *reg = vm->base + CNT_BASE + i * CNT_STRIDE;
+        u32 hi, lo;
 
-    // Check if the device was registered successfully
-    if (major < 0) {
-        // Log error if registration fail
-        printk(KERN_DEBUG "KERNEL mmc: Registering mulmatr device failed\n");
-        pr_alert("KERNEL mmc: Registering mulmatr device failed with %d\n", major);
-        return;
-    }
+        do {
+            hi = readl_relaxed(reg + 4);
+            lo = readl_relaxed(reg);
+        } while (hi != readl_relaxed(reg + 4));
 
-    // Log the assigned major number for the device
-    printk(KERN_DEBUG "KERNEL mmc: I was assigned major number %d.\n", major);
-    pr_info("KERNEL mmc: I was assigned major number %d.\n", major);
+        out[i] = ((u64)hi << 32) | lo;
+    }
+}
 
-    //Linux is 6.6.32
-    cls = class_create(DEVICE_NAME);
+// Write a 64 bit bus address in a LO/HI register pair
+static void vm_write_addr(struct virt_mulmatr *vm, u32 reg_lo, dma_addr_t addr)
+{
+    writel_relaxed(lower_32_bits(addr), vm->base + reg_lo);
+    writel_relaxed(upper_32_bits(addr), vm->base + reg_lo + 4);
+}
 
-    // Create the device in the /dev directory, using the major number assigned
-    device_create(cls, NULL, MKDEV(major, 0), NULL, DEVICE_NAME);
+// Point the device at the GEMV staging buffers
+static void vm_dma_set_default(struct virt_mulmatr *vm)
+{
+    size_t quad = (size_t)vm->max_size * vm->max_size;
+    dma_addr_t a = vm->dma_handle;
+    dma_addr_t b = a + sizeof(u32) * quad;
+    dma_addr_t c = b + sizeof(u32) * vm->max_size;
+
+    vm_write_addr(vm, DMA_A_ADDR_LO, a);
+    vm_write_addr(vm, DMA_B_ADDR_LO, b);
+    vm_write_addr(vm, DMA_C_ADDR_LO, c);
+}
 
-    // Log the creation of the device
-    printk(KERN_DEBUG "KERNEL mmc: Device created on /dev/%s\n", DEVICE_NAME);
-    pr_info("KERNEL mmc: Device created on /dev/%s\n", DEVICE_NAME);
+// Allocate the coherent staging buffers and program their addresses in the device
+static void vm_dma_init(struct virt_mulmatr *vm)
+{
+    size_t quad = (size_t)vm->max_size * vm->max_size;
+    size_t len = sizeof(u32) * (quad + 2 * vm->max_size);
 
-    // Store the base address for the hardware registers
-    base_address = vm->base;
+    if (dma_set_mask_and_coherent(vm->dev, DMA_BIT_MASK(64))) {
+        pr_info("KERNEL mmc: no usable DMA mask, using MMIO transfers\n");
+        return;
+    }
 
-    // Log the base address used for accessing device registers
-    printk(KERN_DEBUG "KERNEL mmc: Base Address: %x\n", base_address);
-    pr_info("KERNEL mmc: Base Address: %x\n", base_address);
+    vm->dma_a = dmam_alloc_coherent(vm->dev, len, &vm->dma_handle, GFP_KERNEL);
+    if (!vm->dma_a) {
+        pr_info("KERNEL mmc: DMA buffer allocation failed, using MMIO transfers\n");
+        return;
+    }
+    vm->dma_b = vm->dma_a + quad;
+    vm->dma_c = vm->dma_b + vm->max_size;
 
-    // Write the default control register value to the device's control register
-    writel_relaxed(DEFAULT_CTRL_REG, vm->base + CONTROL_REG);
+    // The buffers never move, so the addresses are written only once
+    vm_dma_set_default(vm);
 
-    return;
+    pr_info("KERNEL mmc: DMA mode enabled, buffers at %pad\n", &vm->dma_handle);
 }
 
-// Interrupt handler for the device
-static irqreturn_t vm_irq_handler(int irq, void *data)
+// Make room for 'len' words of both B and C of a GEMM
+static int vm_gemm_reserve(struct virt_mulmatr *vm, size_t len)
 {
-    struct virt_mulmatr *vm = (struct virt_mulmatr *)data;
-    u32 status;
-
-    // Log information indicating that the IRQ handler has been raised
-    printk(KERN_DEBUG "KERNEL mmc: Raised IRQ handler\n");
-    pr_info("KERNEL mmc: Raised IRQ handler\n");
+    if (len <= vm->gemm_len)
+        return 0;
 
-    status = readl_relaxed(vm->base + STATUS_REG);  // Read the current device status from the status register
+    if (vm->gemm_buf)
+        dma_free_coherent(vm->dev, sizeof(u32) * 2 * vm->gemm_len, vm->gemm_buf, vm->gemm_handle);
+    vm->gemm_len = 0;
 
-    // Check if the operation has ended
-    if (status & BIT_S_OP_ENDED)
-    {   
-        // Log information indicating that the operation has been ended
-        printk(KERN_DEBUG "KERNEL mmc: IRQ Operation Terminated\n");
-        pr_info("KERNEL mmc: IRQ Operation Terminated\n");
-    }
+    vm->gemm_buf = dma_alloc_coherent(vm->dev, sizeof(u32) * 2 * len, &vm->gemm_handle, GFP_KERNEL);
+    if (!vm->gemm_buf)
+        return -ENOMEM;
 
-    return IRQ_HANDLED;
+    vm->gemm_len = len;
+    return 0;
 }
 
-// Probe function called when the device is detected
-static int vm_probe(struct platform_device *pdev)
+// Elements of A and B in a 32 bit word, from the format selected with WR_FORMAT
+static u32 vm_fmt_per_word(u32 ctrl)
 {
-    struct device *dev = &pdev->dev;
-    struct resource *res;
-    struct virt_mulmatr *vm;
-    int ret;
-
-    // Log information indicating the probe function has been called
-    printk(KERN_DEBUG "KERNEL mmc: vm_probe\n");
-    pr_info("KERNEL mmc: vm_probe\n");
+    switch ((ctrl & CTRL_FMT_MASK) >> CTRL_FMT_SHIFT) {
+    case CTRL_FMT_INT16:
+        return 2;
+    case CTRL_FMT_INT8:
+        return 4;
+    default:
+        return 1;
+    }
+}
 
-    // Get the memory resource from the device tree
-    res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-    if (!res)
-        return -ENOMEM;
+// Pack 'count' values in place, 'per_word' to a word with the first in the low bits; returns the words used
+static u32 vm_pack(u32 *buf, u32 count, u32 per_word)
+{
+    u32 bits = 32 / per_word;
+    u32 w, j;
 
-    // Allocate memory for the virt_mulmatr structure
-    vm = devm_kzalloc(dev, sizeof(*vm), GFP_KERNEL);
-    if (!vm)
-        return -ENOMEM;
+    if (per_word == 1)
+        return count;
 
-    // Set the device pointer and map the device memory into the kernel space
-    vm->dev = dev;
-    vm->base = devm_ioremap(dev, res->start, resource_size(res));
-    if (!vm->base)
-        return -EINVAL;
+    // Word w is built from elements at or after w, nothing unread is overwritten
+    for (w = 0; w < DIV_ROUND_UP(count, per_word); w++) {
+        u32 word = 0;
 
-    // Get the IRQ resource from the device tree
-    res = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
-    if (res) {
-        // Request the IRQ and associate it with the IRQ handler
-        ret = devm_request_irq(dev, res->start, vm_irq_handler,
-                       IRQF_TRIGGER_HIGH, "vm_irq", vm);
-        if (ret)
-            return ret;
+        for (j = 0; j < per_word && w * per_word + j < count; j++)
+            word |= (buf[w * per_word + j] & GENMASK(bits - 1, 0)) << (bits * j);
+        buf[w] = word;
     }
+    return w;
+}
 
-    // Store the device data in the platform device structure
-    platform_set_drvdata(pdev, vm);
+// Reverse of vm_pack(), the elements are sign extended back to 32 bit
+static void vm_unpack(u32 *buf, u32 count, u32 per_word)
+{
+    u32 bits = 32 / per_word;
+    u32 i;
 
-    // Call the initialization function for the device
-    vm_init(vm);
+    if (per_word == 1)
+        return;
 
+    // Backwards, so the packed word of an element is read before its place is written
+    for (i = count; i-- > 0;)
+        buf[i] = sign_extend32(buf[i / per_word] >> (bits * (i % per_word)), bits - 1);
+}
+
+// Copy 'words' words to a matrix window, two per 64 bit store
+static void vm_win_write(void __iomem *win, const u32 *src, size_t words)
+{
+    __iowrite64_copy(win, src, words / 2);
+    if (words & 1)
+        writel_relaxed(src[words - 1], win + sizeof(u32) * (words - 1));
+}
+
+// Copy 'words' words out of a matrix window, memcpy_fromio() reads 64 bit at a time
+static void vm_win_read(u32 *dst, const void __iomem *win, size_t words)
+{
+    memcpy_fromio(dst, win, sizeof(u32) * words);
+}
+
+// Copy 'words' words from user space to a matrix window, XFER_CHUNK at a time through the stack
+static int vm_win_from_user(void __iomem *win, const void __user *src, size_t words)
+{
+    u32 chunk[XFER_CHUNK];
+    size_t done, n;
+
+    for (done = 0; done < words; done += n) {
+        n = min_t(size_t, words - done, XFER_CHUNK);
+        if (copy_from_user(chunk, src + sizeof(u32) * done, sizeof(u32) * n))
+            return -EFAULT;
+        vm_win_write(win + sizeof(u32) * done, chunk, n);
+    }
+    return 0;
+}
+
+// Copy 'words' words of a matrix window to user space, XFER_CHUNK at a time through the stack
+static int vm_win_to_user(void __user *dst, const void __iomem *win, size_t words)
+{
+    u32 chunk[XFER_CHUNK];
+    size_t done, n;
+
+    for (done = 0; done < words; done += n) {
+        n = min_t(size_t, words - done, XFER_CHUNK);
+        vm_win_read(chunk, win + sizeof(u32) * done, n);
+        if (copy_to_user(dst + sizeof(u32) * done, chunk, sizeof(u32) * n))
+            return -EFAULT;
+    }
+    return 0;
+}
+
+// The next end of operation IRQ is the one of the operation about to be started
+static void vm_arm_op(struct virt_mulmatr *vm)
+{
+    spin_lock_irq(&vm->event_lock);
+    vm->op_armed = true;
+    spin_unlock_irq(&vm->event_lock);
+}
+
+// An operation waited for in vain is still in the device: START would be ignored, its late
+// end taken for the next operation and its DMA would land in whatever the staging became.
+// vm_dev_idle() waits for it before anything starts or the staging is reallocated
+static void vm_op_timed_out(struct virt_mulmatr *vm)
+{
+    vm->hw_valid = false;
+    vm->orphaned = true;
+}
+
+// Start 'op' from the registers and wait for it, the control register is left in GEMV mode
+static int vm_run_op(struct virt_mulmatr *vm, u32 op)
+{
+    u32 ctrl = readl_relaxed(vm->base + CONTROL_REG) & ~(CTRL_OP_MASK | BIT_C_USE_SLOT | BIT_C_CSR);
+    u32 status, events;
+    int ret;
+
+    // The GEMM and slot ioctls move 32 bit data and overwrite C, whatever format and
+    // mode the dispatcher left in the register; the IRQ lets the wait sleep
+    events = atomic_read(&vm->op_events);
+    vm_arm_op(vm);
+    writel((ctrl & ~(CTRL_FMT_MASK | BIT_C_ACCUM)) | op | (vm->irq ? BIT_C_END_OP_IRQ_EN : 0) |
+           BIT_C_START_OP, vm->base + CONTROL_REG);
+
+    ret = vm_wait_op(vm, events, &status);
+
+    // Leave no OP_ENDED behind, a later queue IRQ would look like another end of operation
+    writel_relaxed(ctrl | CTRL_OP_GEMV | BIT_C_RESET_STAT, vm->base + CONTROL_REG);
+    if (ret == -ETIMEDOUT)
+        vm_op_timed_out(vm);
+    return ret;
+}
+
+// Index of the slot behind 'handle' of 'vf' holding a size x size matrix, or a negative error
+static int vm_slot_find(struct virt_mulmatr *vm, struct vm_file *vf, u32 handle, u32 size)
+{
+    u32 idx = (handle & 0xff) - 1;
+    struct vm_mslot *ms;
+
+    if (idx >= vm->num_slots)
+        return -ENOENT;
+
+    ms = &vm->mslots[idx];
+    if (!ms->size || (ms->gen & SLOT_GEN_MASK) != handle >> 8)
+        return -ENOENT;
+    if (ms->owner != vf)
+        return -EPERM;
+    if (size && ms->size != size)
+        return -EINVAL;
+
+    ms->last_use = ++vm->slot_clock;
+    return idx;
+}
+
+// Run C = A x B: A in the GEMV staging buffer (or a slot), B and C in the GEMM buffer
+// 'req' is the kernel copy of the caller's request
+static long vm_gemm(struct virt_mulmatr *vm, struct vm_file *vf, const struct mulmatr_gemm *req)
+{
+    size_t quad, len;
+    u32 op = CTRL_OP_GEMM;
+    int ret;
+
+    if (!vm->dma_a)
+        return -EOPNOTSUPP;     // The device reads B and C only through DMA
+
+    if (!req->size || req->size > vm->max_size || !req->k || req->k > vm->max_size)
+        return -EINVAL;
+
+    quad = (size_t)req->size * req->size;
+    len = (size_t)req->size * req->k;
+
+    ret = vm_dev_lock(vm, vf);
+    if (ret)
+        return ret;
+
+    ret = vm_gemm_reserve(vm, len);
+    if (ret)
+        goto out;
+
+    if (req->slot) {
+        ret = vm_slot_find(vm, vf, req->slot, req->size);
+        if (ret < 0)
+            goto out;
+        writel_relaxed(ret, vm->base + SLOT_REG);
+        op |= BIT_C_USE_SLOT;
+    } else if (copy_from_user(vm->dma_a, req->a, sizeof(u32) * quad)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    if (copy_from_user(vm->gemm_buf, req->b, sizeof(u32) * len)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    writel_relaxed(req->size, vm->base + SIZE_REG);
+    writel_relaxed(req->k, vm->base + K_REG);
+    vm_write_addr(vm, DMA_B_ADDR_LO, vm->gemm_handle);
+    vm_write_addr(vm, DMA_C_ADDR_LO, vm->gemm_handle + sizeof(u32) * len);
+
+    ret = vm_run_op(vm, op);
+
+    // Back to the GEMV buffers expected by the other ioctls
+    vm_dma_set_default(vm);
+
+    if (ret)
+        goto out;
+
+    dma_rmb();
+    if (copy_to_user(req->c, vm->gemm_buf + len, sizeof(u32) * len))
+        ret = -EFAULT;
+out:
+    vm_dev_unlock(vm, NULL);
+    return ret;
+}
+
+// Wait for the operation started when op_events was 'events': asleep until the IRQ
+// if the device has one, polling the status register otherwise
+static int vm_wait_op(struct virt_mulmatr *vm, u32 events, u32 *status)
+{
+    int ret = 0;
+
+    if (vm->irq) {
+        if (!wait_event_timeout(vm->op_wait, atomic_read(&vm->op_events) != events,
+                                usecs_to_jiffies(OP_TIMEOUT_US)))
+            ret = -ETIMEDOUT;
+        *status = readl_relaxed(vm->base + STATUS_REG);
+    } else {
+        ret = readl_poll_timeout(vm->base + STATUS_REG, *status,
+                                 *status & BIT_S_OP_ENDED, 10, OP_TIMEOUT_US);
+    }
+
+    if (ret)
+        return ret;
+    if (*status & (BIT_S_DMA_ERR | BIT_S_CMD_ERR))
+        return -EIO;
+    return 0;
+}
+
+// Replace the eventfd signalled when an operation of the file ends, fd < 0 only drops the old one
+static long vm_set_eventfd(struct vm_file *vf, int fd)
+{
+    struct virt_mulmatr *vm = vf->vm;
+    struct eventfd_ctx *ctx = NULL, *old;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    mutex_lock(&vm->lock);
+    spin_lock_irq(&vm->event_lock);
+    old = vf->op_eventfd;
+    vf->op_eventfd = ctx;
+    if (vm->running == vf && (vf->ctrl & BIT_C_END_OP_IRQ_EN))
+        vm->run_eventfd = ctx;
+    spin_unlock_irq(&vm->event_lock);
+    mutex_unlock(&vm->lock);
+
+    if (old)
+        eventfd_ctx_put(old);
+    return 0;
+}
+
+// Size class of a buffer of 'words' words, -1 if it is too big to be pooled
+static int vm_pool_class(size_t words)
+{
+    int cls = words <= (1 << POOL_MIN_SHIFT) ? 0 : order_base_2(words) - POOL_MIN_SHIFT;
+
+    return cls < POOL_CLASSES ? cls : -1;
+}
+
+// Buffers kept in the shared pool for a class, one only past the preallocated classes
+static u32 vm_pool_depth(int cls)
+{
+    return ((size_t)1 << (cls + POOL_MIN_SHIFT)) <= POOL_PREALLOC_WORDS ? POOL_DEPTH : 1;
+}
+
+// A buffer of at least 'words' words, with whatever the last user left in it
+static u32 *vm_pool_get(struct virt_mulmatr *vm, size_t words)
+{
+    struct vm_pool *pool = &vm->pool;
+    int cls = vm_pool_class(words);
+    struct vm_pool_cpu *pc;
+    u32 *buf = NULL;
+
+    if (cls < 0)
+        return kvmalloc_array(words, sizeof(u32), GFP_KERNEL);
+
+    if (pool->cpu && cls < POOL_CPU_CLASSES) {
+        pc = get_cpu_ptr(pool->cpu);
+        buf = pc->buf[cls];
+        pc->buf[cls] = NULL;
+        put_cpu_ptr(pool->cpu);
+    }
+
+    if (!buf) {
+        spin_lock(&pool->lock);
+        if (pool->nfree[cls])
+            buf = pool->free[cls][--pool->nfree[cls]];
+        spin_unlock(&pool->lock);
+    }
+
+    // Cold pool, the buffer stays in it once given back
+    if (!buf)
+        buf = kvmalloc_array((size_t)1 << (cls + POOL_MIN_SHIFT), sizeof(u32), GFP_KERNEL);
+    return buf;
+}
+
+// Give back a buffer of vm_pool_get(), 'words' as asked for then
+static void vm_pool_put(struct virt_mulmatr *vm, u32 *buf, size_t words)
+{
+    struct vm_pool *pool = &vm->pool;
+    int cls = vm_pool_class(words);
+    struct vm_pool_cpu *pc;
+
+    if (!buf || cls < 0) {
+        kvfree(buf);
+        return;
+    }
+
+    if (pool->cpu && cls < POOL_CPU_CLASSES) {
+        pc = get_cpu_ptr(pool->cpu);
+        if (!pc->buf[cls]) {
+            pc->buf[cls] = buf;
+            buf = NULL;
+        }
+        put_cpu_ptr(pool->cpu);
+    }
+
+    if (buf) {
+        spin_lock(&pool->lock);
+        if (pool->nfree[cls] < vm_pool_depth(cls)) {
+            pool->free[cls][pool->nfree[cls]++] = buf;
+            buf = NULL;
+        }
+        spin_unlock(&pool->lock);
+    }
+
+    kvfree(buf);
+}
+
+// Fill the classes of a max size vector and, if not too big, of a max size matrix
+static void vm_pool_init(struct virt_mulmatr *vm)
+{
+    struct vm_pool *pool = &vm->pool;
+    size_t quad = (size_t)vm->max_size * vm->max_size;
+    u32 *bufs[POOL_DEPTH];
+    int i;
+
+    spin_lock_init(&pool->lock);
+    pool->cpu = alloc_percpu(struct vm_pool_cpu);
+
+    // Through get/put, so that the buffers end up where the contexts look first
+    for (i = 0; i < POOL_DEPTH; i++)
+        bufs[i] = vm_pool_get(vm, vm->max_size);
+    for (i = 0; i < POOL_DEPTH; i++)
+        vm_pool_put(vm, bufs[i], vm->max_size);
+
+    if (quad > POOL_PREALLOC_WORDS)
+        return;
+    for (i = 0; i < POOL_DEPTH; i++)
+        bufs[i] = vm_pool_get(vm, quad);
+    for (i = 0; i < POOL_DEPTH; i++)
+        vm_pool_put(vm, bufs[i], quad);
+}
+
+// Free the shared buffers bigger than the preallocated classes, once nobody has the device open
+static void vm_pool_trim(struct virt_mulmatr *vm)
+{
+    struct vm_pool *pool = &vm->pool;
+    u32 *bufs[POOL_CLASSES];
+    int cls, n = 0;
+
+    spin_lock(&pool->lock);
+    for (cls = 0; cls < POOL_CLASSES; cls++) {
+        if (vm_pool_depth(cls) == POOL_DEPTH || !pool->nfree[cls])
+            continue;
+        bufs[n++] = pool->free[cls][0];
+        pool->nfree[cls] = 0;
+    }
+    spin_unlock(&pool->lock);
+
+    while (n)
+        kvfree(bufs[--n]);
+}
+
+static void vm_pool_fini(struct virt_mulmatr *vm)
+{
+    struct vm_pool *pool = &vm->pool;
+    int cls, cpu;
+    u32 i;
+
+    for (cls = 0; cls < POOL_CLASSES; cls++)
+        for (i = 0; i < pool->nfree[cls]; i++)
+            kvfree(pool->free[cls][i]);
+
+    if (!pool->cpu)
+        return;
+    for_each_possible_cpu(cpu)
+        for (cls = 0; cls < POOL_CLASSES; cls++)
+            kvfree(per_cpu_ptr(pool->cpu, cpu)->buf[cls]);
+    free_percpu(pool->cpu);
+}
+
+// Make room in the context for size x size matrices, the values already written are kept
+static int vm_ctx_reserve(struct vm_file *vf, u32 size)
+{
+    struct virt_mulmatr *vm = vf->vm;
+    size_t quad = (size_t)size * size;
+    size_t old = (size_t)vf->cap * vf->cap;
+    u32 *a, *b, *c;
+
+    if (vf->a && size <= vf->cap)
+        return 0;
+
+    a = vm_pool_get(vm, quad);
+    b = vm_pool_get(vm, size);
+    c = vm_pool_get(vm, size);
+    if (!a || !b || !c) {
+        vm_pool_put(vm, a, quad);
+        vm_pool_put(vm, b, size);
+        vm_pool_put(vm, c, size);
+        return -ENOMEM;
+    }
+
+    // Pooled memory holds data of other files, nothing of it may be read back
+    memset(a, 0, sizeof(u32) * quad);
+    memset(b, 0, sizeof(u32) * size);
+    memset(c, 0, sizeof(u32) * size);
+
+    // Like the windows, a bigger size reads the old words with the new layout
+    if (vf->a) {
+        memcpy(a, vf->a, sizeof(u32) * old);
+        memcpy(b, vf->b, sizeof(u32) * vf->cap);
+        memcpy(c, vf->c, sizeof(u32) * vf->cap);
+        vm_ctx_free(vf);
+    }
+    vf->a = a;
+    vf->b = b;
+    vf->c = c;
+    vf->cap = size;
+    return 0;
+}
+
+// Give the buffers of the context back to the pool
+static void vm_ctx_free(struct vm_file *vf)
+{
+    vm_pool_put(vf->vm, vf->a, (size_t)vf->cap * vf->cap);
+    vm_pool_put(vf->vm, vf->b, vf->cap);
+    vm_pool_put(vf->vm, vf->c, vf->cap);
+    vf->a = vf->b = vf->c = NULL;
+}
+
+// Copy 'count' elements of a context to the staging buffer (or the window at 'win_off'), 'per_word' to a word
+static int vm_ctx_load(struct virt_mulmatr *vm, u32 *staging, u32 win_off, const u32 *src,
+                       u32 count, u32 per_word)
+{
+    u32 *buf;
+    u32 words;
+
+    if (staging) {
+        memcpy(staging, src, sizeof(u32) * count);
+        vm_pack(staging, count, per_word);
+        return 0;
+    }
+
+    if (per_word == 1) {
+        vm_win_write(vm->base + win_off, src, count);
+        return 0;
+    }
+
+    // The context keeps one element per word, pack a copy
+    buf = vm_pool_get(vm, count);
+    if (!buf)
+        return -ENOMEM;
+    memcpy(buf, src, sizeof(u32) * count);
+    words = vm_pack(buf, count, per_word);
+    vm_win_write(vm->base + win_off, buf, words);
+    vm_pool_put(vm, buf, count);
+    return 0;
+}
+
+/*
+ * Wait for the operation of the running file and move its result and status
+ * into its context, the device is then free for the next one. Called with
+ * vm->lock held, also by the files that need the device for themselves.
+ */
+static int vm_ctx_retire(struct virt_mulmatr *vm)
+{
+    struct vm_file *vf = vm->running;
+    u32 status;
+    int ret;
+
+    if (!vf)
+        return 0;
+
+    ret = vm_wait_op(vm, vm->run_events, &status);
+    if (ret != -ETIMEDOUT && !(status & (BIT_S_DMA_ERR | BIT_S_CMD_ERR))) {
+        if (vm->dma_c) {
+            dma_rmb();
+            memcpy(vf->c, vm->dma_c, sizeof(u32) * vm->run_size);
+        } else {
+            vm_win_read(vf->c, vm->base + vm->matrc_off, vm->run_size);
+        }
+    }
+    vf->status = status;
+
+    // Clear the status and lower the IRQ, the next operation starts from a clean device
+    writel_relaxed(vm->hw_ctrl | BIT_C_RESET_STAT, vm->base + CONTROL_REG);
+    if (ret == -ETIMEDOUT)
+        vm_op_timed_out(vm);
+
+    spin_lock_irq(&vm->event_lock);
+    vm->run_eventfd = NULL;
+    vm->run_file = NULL;
+    spin_unlock_irq(&vm->event_lock);
+    vm->running = NULL;
+    return ret;
+}
+
+// Take the device for a one-call ioctl, the running operation is collected first
+// With vm->lock held: wait for an operation given up on to really end, -EBUSY if it does
+// not, -ENODEV once the device is removed
+static int vm_dev_idle(struct virt_mulmatr *vm)
+{
+    u32 status;
+
+    if (vm->gone)
+        return -ENODEV;
+    if (!vm->orphaned)
+        return 0;
+
+    if (readl_poll_timeout(vm->base + STATUS_REG, status,
+                           !(status & (BIT_S_OP_STARTED | BIT_S_QUEUE_BUSY)), 10, OP_TIMEOUT_US)) {
+        pr_err("KERNEL mmc: device still busy with a timed out operation\n");
+        return -EBUSY;
+    }
+
+    // Its end is nobody's event
+    spin_lock_irq(&vm->event_lock);
+    vm->op_armed = false;
+    spin_unlock_irq(&vm->event_lock);
+    writel_relaxed(readl_relaxed(vm->base + CONTROL_REG) | BIT_C_RESET_STAT, vm->base + CONTROL_REG);
+    vm->orphaned = false;
+    return 0;
+}
+
+// Take the device for a one-call ioctl of 'vf', the operation in flight is collected first.
+// A mapped device belongs to the mapping file, a balanced job of another file gets -EBUSY
+static int vm_dev_lock(struct virt_mulmatr *vm, struct vm_file *vf)
+{
+    int ret;
+
+    mutex_lock(&vm->lock);
+    if (vm->mmap_owner && vm->mmap_owner != vf) {
+        mutex_unlock(&vm->lock);
+        return -EBUSY;
+    }
+    vm_ctx_retire(vm);
+    ret = vm_dev_idle(vm);
+    if (ret)
+        mutex_unlock(&vm->lock);
+    return ret;
+}
+
+// The one-call ioctls leave their own registers and matrices in the device,
+// 'submit_owner' is the file whose MULMATR_SUBMIT left A there (or NULL)
+static void vm_dev_unlock(struct virt_mulmatr *vm, struct vm_file *submit_owner)
+{
+    vm->hw_valid = false;
+    vm->a_owner = NULL;
+    vm->b_owner = NULL;
+    vm->c_owner = NULL;
+    vm->submit_owner = submit_owner;
+    mutex_unlock(&vm->lock);
+}
+
+/*
+ * Dispatcher: load the context of 'vf' in the device and start its operation.
+ * Only the registers and matrices that differ from what the device already
+ * holds are written, a file running back to back pays for its changes only.
+ * The call returns as soon as the operation is started.
+ */
+static long vm_ctx_start(struct vm_file *vf)
+{
+    struct virt_mulmatr *vm = vf->vm;
+    u32 per_word = vm_fmt_per_word(vf->ctrl);
+    u32 quad = vf->size * vf->size;
+    u32 ctrl;
+    int ret;
+
+    // The device stays enabled for the other files, a disabled context just does not run
+    if (!(vf->ctrl & BIT_C_ENABLE))
+        return -EIO;
+
+    mutex_lock(&vm->lock);
+
+    // One operation at a time: whoever is in the device is collected first
+    vm_ctx_retire(vm);
+    ret = vm_dev_idle(vm);
+    if (ret)
+        goto out;
+
+    if (!vm->hw_valid) {
+        vm->hw_ctrl = readl_relaxed(vm->base + CONTROL_REG);
+        vm->hw_size = readl_relaxed(vm->base + SIZE_REG);
+        vm->hw_alpha = readl_relaxed(vm->base + ALPHA_REG);
+        vm->hw_beta = readl_relaxed(vm->base + BETA_REG);
+        vm->hw_valid = true;
+    }
+
+    if (vm->hw_size != vf->size) {
+        writel_relaxed(vf->size, vm->base + SIZE_REG);
+        vm->hw_size = vf->size;
+    }
+    if ((vf->ctrl & BIT_C_ACCUM) && vm->hw_alpha != vf->alpha) {
+        writel_relaxed(vf->alpha, vm->base + ALPHA_REG);
+        vm->hw_alpha = vf->alpha;
+    }
+    if ((vf->ctrl & BIT_C_ACCUM) && vm->hw_beta != vf->beta) {
+        writel_relaxed(vf->beta, vm->base + BETA_REG);
+        vm->hw_beta = vf->beta;
+    }
+
+    if (vm->a_owner != vf || vf->a_dirty) {
+        vm->a_owner = NULL;
+        vm->submit_owner = NULL;
+        ret = vm_ctx_load(vm, vm->dma_a, vm->matra_off, vf->a, quad, per_word);
+        if (ret)
+            goto out;
+        vm->a_owner = vf;
+        vf->a_dirty = false;
+    }
+    if (vm->b_owner != vf || vf->b_dirty) {
+        vm->b_owner = NULL;
+        ret = vm_ctx_load(vm, vm->dma_b, vm->matrb_off, vf->b, vf->size, per_word);
+        if (ret)
+            goto out;
+        vm->b_owner = vf;
+        vf->b_dirty = false;
+    }
+    // Accumulating on the C of another file would be wrong, put back the last result of this one
+    if ((vf->ctrl & BIT_C_ACCUM) && vm->c_owner != vf) {
+        vm->c_owner = NULL;
+        ret = vm_ctx_load(vm, vm->dma_c, vm->matrc_off, vf->c, vf->size, 1);
+        if (ret)
+            goto out;
+    }
+    vm->c_owner = vf;
+
+    // GEMV with the format and mode of the file, the IRQ is always on so that the dispatcher can sleep
+    ctrl = (vm->hw_ctrl & ~(VM_CTX_HW_CTRL | CTRL_OP_MASK | BIT_C_USE_SLOT | BIT_C_CSR)) |
+           (vf->ctrl & VM_CTX_HW_CTRL) | BIT_C_ENABLE | CTRL_OP_GEMV |
+           (vm->irq ? BIT_C_END_OP_IRQ_EN : 0);
+    vm->hw_ctrl = ctrl;
+
+    vm->running = vf;
+    vm->run_size = vf->size;
+    vm->run_events = atomic_read(&vm->op_events);
+    vf->status = BIT_S_OP_STARTED;
+    spin_lock_irq(&vm->event_lock);
+    vm->run_eventfd = (vf->ctrl & BIT_C_END_OP_IRQ_EN) ? vf->op_eventfd : NULL;
+    vm->run_file = vf;
+    vm->op_armed = true;
+    spin_unlock_irq(&vm->event_lock);
+
+    // Non-relaxed write: staged DMA operands must be visible to the device first
+    writel(ctrl | BIT_C_START_OP, vm->base + CONTROL_REG);
+    ret = 0;
+out:
+    mutex_unlock(&vm->lock);
+    return ret;
+}
+
+static long vm_submit(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_submit __user *uarg)
+{
+    struct mulmatr_submit req;
+    u32 ctrl, status, events;
+    size_t quad;
+    int ret = 0;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+
+    if (!req.size || req.size > vm->max_size || (req.flags & ~MULMATR_SUBMIT_KEEP_A))
+        return -EINVAL;
+
+    quad = (size_t)req.size * req.size;
+
+    ret = vm_dev_lock(vm, vf);
+    if (ret)
+        return ret;
+
+    // Other files may have loaded their A since the last MULMATR_SUBMIT of this one
+    if ((req.flags & MULMATR_SUBMIT_KEEP_A) && vm->submit_owner != vf) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (vm->dma_a) {
+        // DMA mode: the operands go to the staging buffers, C comes back in dma_c
+        if ((!(req.flags & MULMATR_SUBMIT_KEEP_A) &&
+             copy_from_user(vm->dma_a, req.a, sizeof(u32) * quad)) ||
+            copy_from_user(vm->dma_b, req.b, sizeof(u32) * req.size)) {
+            ret = -EFAULT;
+            goto out;
+        }
+    } else {
+        // Straight from user space to the windows, without a kernel copy of A
+        if (!(req.flags & MULMATR_SUBMIT_KEEP_A))
+            ret = vm_win_from_user(vm->base + vm->matra_off, req.a, quad);
+        if (!ret)
+            ret = vm_win_from_user(vm->base + vm->matrb_off, req.b, req.size);
+        if (ret)
+            goto out;
+    }
+
+    writel_relaxed(req.size, vm->base + SIZE_REG);
+
+    // 32 bit GEMV overwriting C, with the IRQ on so that the wait can sleep
+    ctrl = readl_relaxed(vm->base + CONTROL_REG);
+    events = atomic_read(&vm->op_events);
+    vm_arm_op(vm);
+    writel((ctrl & ~(CTRL_OP_MASK | BIT_C_USE_SLOT | BIT_C_CSR | CTRL_FMT_MASK | BIT_C_ACCUM)) |
+           CTRL_OP_GEMV | (vm->irq ? BIT_C_END_OP_IRQ_EN : 0) | BIT_C_START_OP,
+           vm->base + CONTROL_REG);
+
+    ret = vm_wait_op(vm, events, &status);
+
+    // Back to the control register the dispatcher left, with the status cleared
+    writel_relaxed(ctrl | BIT_C_RESET_STAT, vm->base + CONTROL_REG);
+    if (ret == -ETIMEDOUT)
+        vm_op_timed_out(vm);
+
+    if (ret)
+        goto out;
+
+    if (vm->dma_a) {
+        dma_rmb();
+        if (copy_to_user(req.c, vm->dma_c, sizeof(u32) * req.size))
+            ret = -EFAULT;
+    } else {
+        ret = vm_win_to_user(req.c, vm->base + vm->matrc_off, req.size);
+    }
+out:
+    vm_dev_unlock(vm, ret ? NULL : vf);
+    return ret;
+}
+
+static int vm_csr_reserve(struct virt_mulmatr *vm, size_t words)
+{
+    if (words <= vm->csr_words)
+        return 0;
+
+    if (vm->csr_buf)
+        dma_free_coherent(vm->dev, sizeof(u32) * vm->csr_words, vm->csr_buf, vm->csr_handle);
+    vm->csr_words = 0;
+
+    vm->csr_buf = dma_alloc_coherent(vm->dev, sizeof(u32) * words, &vm->csr_handle, GFP_KERNEL);
+    if (!vm->csr_buf)
+        return -ENOMEM;
+
+    vm->csr_words = words;
+    return 0;
+}
+
+// Sparse product: only the nnz entries of A are uploaded, the device checks the indexes
+static long vm_csr(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_csr __user *uarg)
+{
+    struct mulmatr_csr req;
+    size_t len, ptrs;
+    dma_addr_t col, val;
+    int ret;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+
+    if (!vm->dma_a)
+        return -EOPNOTSUPP;     // The device reads a sparse A only through DMA
+
+    if (!req.size || req.size > vm->max_size || !req.k || req.k > vm->max_size ||
+        req.nnz > (u64)req.size * req.size)
+        return -EINVAL;
+
+    ptrs = (size_t)req.size + 1;
+    len = (size_t)req.size * req.k;
+    col = sizeof(u32) * ptrs;
+    val = col + sizeof(u32) * req.nnz;
+
+    ret = vm_dev_lock(vm, vf);
+    if (ret)
+        return ret;
+
+    ret = vm_gemm_reserve(vm, len);
+    if (!ret)
+        ret = vm_csr_reserve(vm, ptrs + 2 * (size_t)req.nnz);
+    if (ret)
+        goto out;
+
+    if (copy_from_user(vm->csr_buf, req.rowptr, sizeof(u32) * ptrs) ||
+        copy_from_user(vm->csr_buf + ptrs, req.colidx, sizeof(u32) * req.nnz) ||
+        copy_from_user(vm->csr_buf + ptrs + req.nnz, req.values, sizeof(u32) * req.nnz) ||
+        copy_from_user(vm->gemm_buf, req.b, sizeof(u32) * len)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    writel_relaxed(req.size, vm->base + SIZE_REG);
+    writel_relaxed(req.k, vm->base + K_REG);
+    writel_relaxed(req.nnz, vm->base + NNZ_REG);
+    vm_write_addr(vm, DMA_A_ADDR_LO, vm->csr_handle);
+    vm_write_addr(vm, CSR_COL_ADDR_LO, vm->csr_handle + col);
+    vm_write_addr(vm, CSR_VAL_ADDR_LO, vm->csr_handle + val);
+    vm_write_addr(vm, DMA_B_ADDR_LO, vm->gemm_handle);
+    vm_write_addr(vm, DMA_C_ADDR_LO, vm->gemm_handle + sizeof(u32) * len);
+
+    ret = vm_run_op(vm, CTRL_OP_GEMM | BIT_C_CSR);
+
+    // Back to the GEMV buffers expected by the other ioctls
+    vm_dma_set_default(vm);
+
+    if (ret)
+        goto out;
+
+    dma_rmb();
+    if (copy_to_user(req.c, vm->gemm_buf + len, sizeof(u32) * len))
+        ret = -EFAULT;
+out:
+    vm_dev_unlock(vm, NULL);
+    return ret;
+}
+
+// Free slot for a load, else the least recently used one that is not pinned
+static int vm_slot_pick(struct virt_mulmatr *vm)
+{
+    int victim = -ENOSPC;
+    u32 i;
+
+    for (i = 0; i < vm->num_slots; i++) {
+        struct vm_mslot *ms = &vm->mslots[i];
+
+        if (!ms->size)
+            return i;
+        if (!ms->pinned && (victim < 0 || ms->last_use < vm->mslots[victim].last_use))
+            victim = i;
+    }
+    return victim;
+}
+
+// Copy A into the device slot 'idx', through DMA or the matrix A window
+static int vm_slot_upload(struct virt_mulmatr *vm, u32 idx, u32 size, const __s32 __user *a)
+{
+    size_t quad = (size_t)size * size;
+    int ret;
+
+    if (vm->dma_a)
+        ret = copy_from_user(vm->dma_a, a, sizeof(u32) * quad) ? -EFAULT : 0;
+    else
+        ret = vm_win_from_user(vm->base + vm->matra_off, a, quad);
+    if (ret)
+        return ret;
+
+    writel_relaxed(size, vm->base + SIZE_REG);
+    writel_relaxed(idx, vm->base + SLOT_REG);
+    return vm_run_op(vm, CTRL_OP_LOAD_SLOT);
+}
+
+static long vm_slot_load(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_slot __user *uarg)
+{
+    struct mulmatr_slot req;
+    struct vm_mslot *ms;
+    int idx, ret;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+
+    if (!vm->num_slots)
+        return -EOPNOTSUPP;
+    if (!req.size || req.size > vm->max_size || req.flags & ~MULMATR_SLOT_PINNED)
+        return -EINVAL;
+
+    ret = vm_dev_lock(vm, vf);
+    if (ret)
+        return ret;
+
+    idx = vm_slot_pick(vm);
+    if (idx < 0) {
+        ret = idx;
+        goto out;
+    }
+
+    // Whatever was in the slot is gone, even if the upload fails
+    ms = &vm->mslots[idx];
+    ms->size = 0;
+    ms->gen++;
+    ms->owner = NULL;
+
+    ret = vm_slot_upload(vm, idx, req.size, req.a);
+    if (ret)
+        goto out;
+
+    ms->size = req.size;
+    ms->pinned = req.flags & MULMATR_SLOT_PINNED;
+    ms->last_use = ++vm->slot_clock;
+    ms->owner = vf;
+
+    req.handle = ((ms->gen & SLOT_GEN_MASK) << 8) | (idx + 1);
+    if (put_user(req.handle, &uarg->handle))
+        ret = -EFAULT;
+out:
+    vm_dev_unlock(vm, NULL);
+    return ret;
+}
+
+static long vm_slot_pin(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_slot __user *uarg)
+{
+    struct mulmatr_slot req;
+    int idx;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+
+    if (req.flags & ~MULMATR_SLOT_PINNED)
+        return -EINVAL;
+
+    mutex_lock(&vm->lock);
+    idx = vm_slot_find(vm, vf, req.handle, 0);
+    if (idx >= 0)
+        vm->mslots[idx].pinned = req.flags & MULMATR_SLOT_PINNED;
+    mutex_unlock(&vm->lock);
+
+    return idx < 0 ? idx : 0;
+}
+
+// Forget slot 'idx' and release it in the device, with the device held
+static int vm_slot_drop(struct virt_mulmatr *vm, u32 idx)
+{
+    vm->mslots[idx].size = 0;
+    vm->mslots[idx].pinned = false;
+    vm->mslots[idx].gen++;
+    vm->mslots[idx].owner = NULL;
+
+    writel_relaxed(idx, vm->base + SLOT_REG);
+    return vm_run_op(vm, CTRL_OP_FREE_SLOT);
+}
+
+static long vm_slot_free(struct virt_mulmatr *vm, struct vm_file *vf, u32 handle)
+{
+    int idx, ret;
+
+    ret = vm_dev_lock(vm, vf);
+    if (ret)
+        return ret;
+
+    idx = vm_slot_find(vm, vf, handle, 0);
+    if (idx < 0) {
+        ret = idx;
+        goto out;
+    }
+
+    ret = vm_slot_drop(vm, idx);
+out:
+    vm_dev_unlock(vm, NULL);
+    return ret;
+}
+
+// Free the slots of a closing file, under vm->lock; true if the device was used
+static bool vm_slot_release(struct virt_mulmatr *vm, struct vm_file *vf)
+{
+    bool used = false;
+    bool stuck = false;
+    u32 i;
+
+    for (i = 0; i < vm->num_slots; i++) {
+        if (!vm->mslots[i].size || vm->mslots[i].owner != vf)
+            continue;
+        // Whatever is in flight has to end before the free goes in
+        if (!used) {
+            vm_ctx_retire(vm);
+            stuck = vm_dev_idle(vm) != 0;
+            used = true;
+        }
+        // A stuck device keeps the matrix until the next load of the slot
+        if (stuck) {
+            vm->mslots[i].size = 0;
+            vm->mslots[i].pinned = false;
+            vm->mslots[i].gen++;
+            vm->mslots[i].owner = NULL;
+        } else {
+            vm_slot_drop(vm, i);
+            // A free that timed out is still in the device, nothing more starts behind it
+            stuck = vm->orphaned;
+        }
+    }
+    return used;
+}
+
+// Allocate the queues and program them in the device
+static void vm_queue_init(struct virt_mulmatr *vm)
+{
+    size_t len = sizeof(struct vm_sqe) * Q_ENTRIES + sizeof(struct vm_cqe) * Q_ENTRIES;
+    struct vm_sqe *sq;
+
+    if (!vm->dma_a)
+        return;
+
+    sq = dmam_alloc_coherent(vm->dev, len, &vm->q_handle, GFP_KERNEL);
+    if (!sq) {
+        pr_info("KERNEL mmc: queue allocation failed, MULMATR_BATCH disabled\n");
+        return;
+    }
+
+    vm->cq_phase = 1;
+    vm->cq = (struct vm_cqe *)(sq + Q_ENTRIES);
+    vm->sq = sq;    // Set last, the IRQ handler checks it
+
+    vm_write_addr(vm, SQ_BASE_LO, vm->q_handle);
+    vm_write_addr(vm, CQ_BASE_LO, vm->q_handle + sizeof(struct vm_sqe) * Q_ENTRIES);
+    writel_relaxed(Q_ENTRIES, vm->base + Q_SIZE_REG);
+}
+
+// Stop the queues after the device stopped answering. The job it may still run writes C
+// into its entry: the entries stay as they are, vm_dev_idle() waits for the job to end
+// and the next batch restarts the queues from empty
+static void vm_queue_stop(struct virt_mulmatr *vm)
+{
+    writel_relaxed(readl_relaxed(vm->base + CONTROL_REG) & ~BIT_C_QUEUE_EN, vm->base + CONTROL_REG);
+    vm->inflight = 0;
+    vm_op_timed_out(vm);
+}
+
+// Restart the queues from empty, the device resets its pointers on QUEUE_EN 0->1
+static void vm_queue_reset(struct virt_mulmatr *vm)
+{
+    u32 ctrl = readl_relaxed(vm->base + CONTROL_REG) & ~BIT_C_QUEUE_EN;
+
+    writel_relaxed(ctrl, vm->base + CONTROL_REG);
+    memset(vm->cq, 0, sizeof(struct vm_cqe) * Q_ENTRIES);
+    vm->sq_tail = 0;
+    vm->cq_head = 0;
+    vm->cq_phase = 1;
+    vm->inflight = 0;
+    writel(ctrl | BIT_C_QUEUE_EN, vm->base + CONTROL_REG);
+}
+
+// Make room for 'words' words of staging memory in a queue entry
+static int vm_qentry_reserve(struct virt_mulmatr *vm, struct vm_qentry *ent, size_t words)
+{
+    if (words <= ent->words)
+        return 0;
+
+    if (ent->buf)
+        dma_free_coherent(vm->dev, sizeof(u32) * ent->words, ent->buf, ent->handle);
+    ent->words = 0;
+
+    ent->buf = dma_alloc_coherent(vm->dev, sizeof(u32) * words, &ent->handle, GFP_KERNEL);
+    if (!ent->buf)
+        return -ENOMEM;
+
+    ent->words = words;
+    return 0;
+}
+
+// Stage one job in the entry at sq_tail and fill its descriptor, the doorbell is rung later
+static int vm_queue_job(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_gemm __user *ujob)
+{
+    u32 idx = vm->sq_tail;
+    struct vm_qentry *ent = &vm->qents[idx];
+    struct vm_sqe *sqe = &vm->sq[idx];
+    size_t quad, len;
+    int slot = 0;
+    int ret;
+
+    if (copy_from_user(&ent->req, ujob, sizeof(ent->req)))
+        return -EFAULT;
+
+    if (!ent->req.size || ent->req.size > vm->max_size ||
+        !ent->req.k || ent->req.k > vm->max_size)
+        return -EINVAL;
+
+    // With a slot, A is already in the device and is not staged
+    quad = (size_t)ent->req.size * ent->req.size;
+    if (ent->req.slot) {
+        slot = vm_slot_find(vm, vf, ent->req.slot, ent->req.size);
+        if (slot < 0)
+            return slot;
+        quad = 0;
+    }
+    len = (size_t)ent->req.size * ent->req.k;
+    ent->c_off = quad + len;
+
+    ret = vm_qentry_reserve(vm, ent, quad + 2 * len);
+    if (ret)
+        return ret;
+
+    if (copy_from_user(ent->buf, ent->req.a, sizeof(u32) * quad) ||
+        copy_from_user(ent->buf + quad, ent->req.b, sizeof(u32) * len))
+        return -EFAULT;
+
+    sqe->ctrl = cpu_to_le32(CTRL_OP_GEMM | (ent->req.slot ? BIT_C_USE_SLOT : 0));
+    sqe->slot = cpu_to_le32(slot);
+    sqe->size = cpu_to_le32(ent->req.size);
+    sqe->k = cpu_to_le32(ent->req.k);
+    sqe->tag = cpu_to_le32(idx);
+    sqe->a_addr = cpu_to_le64(ent->handle);
+    sqe->b_addr = cpu_to_le64(ent->handle + sizeof(u32) * quad);
+    sqe->c_addr = cpu_to_le64(ent->handle + sizeof(u32) * (quad + len));
+
+    vm->sq_tail = (idx + 1) % Q_ENTRIES;
+    vm->inflight++;
+    return 0;
+}
+
+static bool vm_cq_pending(struct virt_mulmatr *vm)
+{
+    u32 phase = le32_to_cpu(READ_ONCE(vm->cq[vm->cq_head].phase)) & 1;
+
+    return vm->inflight && phase == vm->cq_phase;
+}
+
+// Sleep until a completion is posted, polling once per tick without an IRQ line
+static int vm_cq_wait(struct virt_mulmatr *vm)
+{
+    unsigned long deadline = jiffies + usecs_to_jiffies(OP_TIMEOUT_US);
+    long step = vm->irq ? usecs_to_jiffies(OP_TIMEOUT_US) : 1;
+
+    while (!vm_cq_pending(vm)) {
+        if (time_after(jiffies, deadline))
+            return -ETIMEDOUT;
+        wait_event_timeout(vm->cq_wait, vm_cq_pending(vm), step);
+    }
     return 0;
 }
 
+// Consume the posted completions, copy C back and return the entries to the device
+static int vm_cq_reap(struct virt_mulmatr *vm, u32 *done)
+{
+    int ret = 0;
+
+    while (vm_cq_pending(vm)) {
+        struct vm_cqe *cqe = &vm->cq[vm->cq_head];
+        struct vm_qentry *ent;
+        size_t len;
+        u32 status;
+
+        dma_rmb();      // Read the entry (and C) only after seeing its phase
+        ent = &vm->qents[le32_to_cpu(cqe->tag) % Q_ENTRIES];
+        status = le32_to_cpu(cqe->status);
+        len = (size_t)ent->req.size * ent->req.k;
+
+        if (status & (BIT_S_DMA_ERR | BIT_S_CMD_ERR))
+            ret = -EIO;
+        else if (copy_to_user(ent->req.c, ent->buf + ent->c_off, sizeof(u32) * len))
+            ret = -EFAULT;
+        else if (!ret)
+            (*done)++;
+
+        if (++vm->cq_head == Q_ENTRIES) {
+            vm->cq_head = 0;
+            vm->cq_phase ^= 1;
+        }
+        vm->inflight--;
+    }
+
+    writel_relaxed(vm->cq_head, vm->base + CQ_HEAD_DB);
+    return ret;
+}
+
+/*
+ * Keep the device busy: every free entry is filled and announced with a single
+ * doorbell, then completions are reaped (one IRQ per batch) and the freed
+ * entries refilled while the device works on the rest of the queue.
+ */
+static long vm_batch(struct virt_mulmatr *vm, struct vm_file *vf, struct mulmatr_batch __user *uarg)
+{
+    struct mulmatr_batch req;
+    u32 next = 0, done = 0;
+    u32 ctrl;
+    int ret = 0, err;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+
+    if (!vm->sq)
+        return -EOPNOTSUPP;
+
+    ret = vm_dev_lock(vm, vf);
+    if (ret)
+        return ret;
+
+    // The queue (and the batch IRQ) may have been turned off through the other ioctls
+    ctrl = readl_relaxed(vm->base + CONTROL_REG);
+    if (vm->irq && !(ctrl & BIT_C_END_OP_IRQ_EN))
+        writel_relaxed(ctrl | BIT_C_END_OP_IRQ_EN, vm->base + CONTROL_REG);
+    if (!(ctrl & BIT_C_QUEUE_EN))
+        vm_queue_reset(vm);
+
+    while (done < req.count) {
+        u32 queued = 0;
+
+        while (!ret && next < req.count && vm->inflight < Q_ENTRIES - 1) {
+            ret = vm_queue_job(vm, vf, &req.jobs[next]);
+            if (!ret) {
+                next++;
+                queued++;
+            }
+        }
+
+        // Non-relaxed write: the descriptors must be visible before the doorbell
+        if (queued)
+            writel(vm->sq_tail, vm->base + SQ_TAIL_DB);
+
+        if (!vm->inflight)
+            break;
+
+        err = vm_cq_wait(vm);
+        if (err) {
+            // The device stopped answering, drop whatever it still owns
+            vm_queue_stop(vm);
+            ret = err;
+            break;
+        }
+
+        err = vm_cq_reap(vm, &done);
+        if (err && !ret)
+            ret = err;
+        if (ret && !vm->inflight)
+            break;
+    }
+
+    vm_dev_unlock(vm, NULL);
+
+    if (put_user(done, &uarg->done))
+        return -EFAULT;
+    return ret;
+}
+
+// Initialize the device
+static void vm_init(struct virt_mulmatr *vm)
+{
+    pr_debug("KERNEL mmc: vm_init\n");
+
+    // Log the base address used for accessing device registers
+    pr_info("KERNEL mmc: Base Address: %pa\n", &vm->phys);
+
+    // A disabled device reads as 0 everywhere, the CAP registers included:
+    // enable it first in case a previous user left it off
+    writel_relaxed(DEFAULT_CTRL_REG, vm->base + CONTROL_REG);
+
+    // Read the device limits instead of assuming them
+    vm->max_size = readl_relaxed(vm->base + CAP_MAX_SIZE_REG);
+    vm->matra_off = readl_relaxed(vm->base + CAP_MATRA_OFF_REG);
+    vm->matrb_off = readl_relaxed(vm->base + CAP_MATRB_OFF_REG);
+    vm->matrc_off = readl_relaxed(vm->base + CAP_MATRC_OFF_REG);
+    pr_info("KERNEL mmc: max size %u, windows at 0x%x 0x%x 0x%x\n", vm->max_size,
+            vm->matra_off, vm->matrb_off, vm->matrc_off);
+
+    vm->num_slots = min_t(u32, readl_relaxed(vm->base + CAP_SLOTS_REG), MAX_SLOTS);
+    mutex_init(&vm->lock);
+    vm_pool_init(vm);
+
+    // Set up the DMA staging buffers and the queues, if the platform allows it
+    vm_dma_init(vm);
+    vm_queue_init(vm);
+
+    // Write the default control register value to the device's control register
+    writel_relaxed(DEFAULT_CTRL_REG | (vm->dma_a ? BIT_C_DMA_MODE : 0) |
+                   (vm->sq ? BIT_C_QUEUE_EN : 0), vm->base + CONTROL_REG);
+
+    return;
+}
+
+// Interrupt handler for the device
+static irqreturn_t vm_irq_handler(int irq, void *data)
+{
+    struct virt_mulmatr *vm = (struct virt_mulmatr *)data;
+    bool ended;
+    u32 status;
+
+    // Log information indicating that the IRQ handler has been raised
+    pr_debug("KERNEL mmc: Raised IRQ handler\n");
+
+    status = readl_relaxed(vm->base + STATUS_REG);  // Read the current device status from the status register
+
+    // OP_ENDED stays set until a status reset: only the first IRQ after a start is its end.
+    // A mapping starts operations behind the driver, its IRQs count unless they are queue ones.
+    // The end goes to the file whose operation it is; those of the one-call ioctls to nobody.
+    spin_lock(&vm->event_lock);
+    ended = (status & BIT_S_OP_ENDED) &&
+            (vm->op_armed || (vm->mmap_owner && !(status & BIT_S_QUEUE_DONE)));
+    if (ended) {
+        struct vm_file *owner = vm->op_armed ? vm->run_file : vm->mmap_owner;
+
+        vm->op_armed = false;
+        if (owner)
+            atomic_inc(&owner->op_events);
+        if (vm->run_eventfd)
+            eventfd_signal(vm->run_eventfd, 1);
+    }
+    spin_unlock(&vm->event_lock);
+
+    // Check if the operation has ended
+    if (ended)
+    {   
+        // Log information indicating that the operation has been ended
+        pr_debug("KERNEL mmc: IRQ Operation Terminated\n");
+
+        // Wake the driver waits, and read() and poll() of the file it was counted for
+        atomic_inc(&vm->op_events);
+        wake_up(&vm->op_wait);
+    }
+
+    // Completions posted in the queue, wake the batch waiting for them
+    if ((status & BIT_S_QUEUE_DONE) && vm->sq)
+        wake_up(&vm->cq_wait);
+
+    return IRQ_HANDLED;
+}
+
+// Release the DMA memory vm_init() set up and devres does not manage, the pool
+// stays until the last reference since closing files still give buffers back
+static void vm_fini(struct virt_mulmatr *vm)
+{
+    int i;
+
+    // The GEMM and CSR buffers and the queue entry buffers are the only DMA memory not managed by devres
+    if (vm->gemm_buf)
+        dma_free_coherent(vm->dev, sizeof(u32) * 2 * vm->gemm_len, vm->gemm_buf, vm->gemm_handle);
+    if (vm->csr_buf)
+        dma_free_coherent(vm->dev, sizeof(u32) * vm->csr_words, vm->csr_buf, vm->csr_handle);
+    for (i = 0; i < Q_ENTRIES; i++)
+        if (vm->qents[i].buf)
+            dma_free_coherent(vm->dev, sizeof(u32) * vm->qents[i].words,
+                              vm->qents[i].buf, vm->qents[i].handle);
+}
+
+// Give the instance the first free minor and its node, files can open it from here on
+static int vm_cdev_add(struct virt_mulmatr *vm)
+{
+    struct device *node;
+    int ret = 0;
+
+    mutex_lock(&vm_devs_lock);
+    for (vm->index = 0; vm->index < VM_MAX_DEVICES; vm->index++)
+        if (!vm_devs[vm->index])
+            break;
+    if (vm->index == VM_MAX_DEVICES) {
+        pr_alert("KERNEL mmc: more than %d devices, not registered\n", VM_MAX_DEVICES);
+        ret = -EBUSY;
+        goto out;
+    }
+
+    // Allocated apart: a file still open after remove puts it after the instance is gone
+    vm->cdev = cdev_alloc();
+    if (!vm->cdev) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    vm->cdev->ops = &dev_fops;
+    vm->cdev->owner = THIS_MODULE;
+    ret = cdev_add(vm->cdev, MKDEV(MAJOR(vm_devt), vm->index), 1);
+    if (ret) {
+        kobject_put(&vm->cdev->kobj);
+        goto out;
+    }
+
+    // The first instance keeps the name the single device had
+    if (vm->index)
+        node = device_create(vm_class, vm->dev, MKDEV(MAJOR(vm_devt), vm->index), vm,
+                             DEVICE_NAME "%d", vm->index);
+    else
+        node = device_create(vm_class, vm->dev, MKDEV(MAJOR(vm_devt), 0), vm, DEVICE_NAME);
+    if (IS_ERR(node)) {
+        cdev_del(vm->cdev);
+        ret = PTR_ERR(node);
+        goto out;
+    }
+    vm_devs[vm->index] = vm;
+
+    // Log the creation of the device
+    pr_info("KERNEL mmc: Device created on /dev/%s\n", dev_name(node));
+out:
+    mutex_unlock(&vm_devs_lock);
+    return ret;
+}
+
+static void vm_cdev_del(struct virt_mulmatr *vm)
+{
+    mutex_lock(&vm_devs_lock);
+    vm_devs[vm->index] = NULL;
+    mutex_unlock(&vm_devs_lock);
+
+    device_destroy(vm_class, MKDEV(MAJOR(vm_devt), vm->index));
+    cdev_del(vm->cdev);
+}
+
+// Probe function called when the device is detected
+static int vm_probe(struct platform_device *pdev)
+{
+    struct device *dev = &pdev->dev;
+    struct resource *res;
+    struct virt_mulmatr *vm;
+    int ret;
+
+    // Log information indicating the probe function has been called
+    pr_debug("KERNEL mmc: vm_probe\n");
+
+    // Get the memory resource from the device tree
+    res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+    if (!res)
+        return -ENOMEM;
+
+    // Not devres memory: open files and balanced jobs can outlive the binding
+    vm = kzalloc(sizeof(*vm), GFP_KERNEL);
+    if (!vm)
+        return -ENOMEM;
+    kref_init(&vm->ref);
+
+    // Set the device pointer and map the device memory into the kernel space
+    vm->dev = dev;
+    vm->base = devm_ioremap(dev, res->start, resource_size(res));
+    if (!vm->base) {
+        ret = -EINVAL;
+        goto err_free;
+    }
+    vm->phys = res->start;
+    vm->phys_size = resource_size(res);
+    init_waitqueue_head(&vm->op_wait);
+    init_waitqueue_head(&vm->cq_wait);
+    spin_lock_init(&vm->event_lock);
+
+    // Get the IRQ resource from the device tree
+    res = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
+    if (res) {
+        // Request the IRQ and associate it with the IRQ handler
+        ret = devm_request_irq(dev, res->start, vm_irq_handler,
+                       IRQF_TRIGGER_HIGH, "vm_irq", vm);
+        if (ret)
+            goto err_free;
+        vm->irq = res->start;
+    }
+
+    // Store the device data in the platform device structure
+    platform_set_drvdata(pdev, vm);
+
+    // Call the initialization function for the device
+    vm_init(vm);
+
+    ret = vm_cdev_add(vm);
+    if (!ret)
+        return 0;
+
+    vm_fini(vm);
+err_free:
+    // The handler must not outlive the instance it was given
+    if (vm->irq)
+        devm_free_irq(dev, vm->irq, vm);
+    kref_put(&vm->ref, vm_release);
+    return ret;
+}
+
 // Remove function called when the device is removed
 static int vm_remove(struct platform_device *pdev)
 {
+    struct virt_mulmatr *vm = platform_get_drvdata(pdev);
+
+    // No new file or balanced job finds the instance from here on
+    vm_cdev_del(vm);
+
+    // With the lock, the running operation is collected and the one-call ioctls are
+    // done; whoever takes it next sees 'gone' and leaves the device alone
+    mutex_lock(&vm->lock);
+    vm_ctx_retire(vm);
+    vm_dev_idle(vm);
+    vm->gone = true;
+    if (vm->mmap_owner)
+        unmap_mapping_range(vm->mmap_mapping, 0, 0, 1);
+    // Off, with its IRQ; the next probe enables it again
+    writel(0, vm->base + CONTROL_REG);
+    mutex_unlock(&vm->lock);
+
+    // read() and poll() return, the waits of the driver are over already
+    wake_up_all(&vm->op_wait);
+    wake_up_all(&vm->cq_wait);
+
+    // The handler uses the instance, devres would free the line only after it is put
+    if (vm->irq)
+        devm_free_irq(vm->dev, vm->irq, vm);
+    vm_fini(vm);
+    kref_put(&vm->ref, vm_release);
+
     // Log information indicating the device driver is being detached
-    printk(KERN_DEBUG "KERNEL mmc: detaching device driver\n");
-    pr_info("KERNEL mmc: detaching device driver\n");
+    pr_debug("KERNEL mmc: detaching device driver\n");
 
     return 0;
 }
@@ -556,7 +2700,65 @@ static struct platform_driver vm_driver = {
         .of_match_table = vm_of_match,
     },
 };
-module_platform_driver(vm_driver);  // Register the platform driver with the kernel
+
+// The minors, the class and /dev/mulmatr outlive the instances coming and going
+static int __init vm_module_init(void)
+{
+    int ret;
+
+    ret = alloc_chrdev_region(&vm_devt, 0, VM_MAX_DEVICES + 1, DEVICE_NAME);
+    if (ret) {
+        pr_alert("KERNEL mmc: Registering mulmatr device failed with %d\n", ret);
+        return ret;
+    }
+    pr_info("KERNEL mmc: I was assigned major number %d.\n", MAJOR(vm_devt));
+
+    //Linux is 6.6.32
+    vm_class = class_create(DEVICE_NAME);
+    if (IS_ERR(vm_class)) {
+        ret = PTR_ERR(vm_class);
+        goto err_region;
+    }
+
+    if (lb_node) {
+        cdev_init(&vm_lb_cdev, &dev_fops);
+        vm_lb_cdev.owner = THIS_MODULE;
+        ret = cdev_add(&vm_lb_cdev, MKDEV(MAJOR(vm_devt), VM_LB_MINOR), 1);
+        if (ret)
+            goto err_class;
+        device_create(vm_class, NULL, MKDEV(MAJOR(vm_devt), VM_LB_MINOR), NULL, LB_DEVICE_NAME);
+    }
+
+    // Register the platform driver with the kernel
+    ret = platform_driver_register(&vm_driver);
+    if (ret)
+        goto err_lb;
+    return 0;
+
+err_lb:
+    if (lb_node) {
+        device_destroy(vm_class, MKDEV(MAJOR(vm_devt), VM_LB_MINOR));
+        cdev_del(&vm_lb_cdev);
+    }
+err_class:
+    class_destroy(vm_class);
+err_region:
+    unregister_chrdev_region(vm_devt, VM_MAX_DEVICES + 1);
+    return ret;
+}
+module_init(vm_module_init);
+
+static void __exit vm_module_exit(void)
+{
+    platform_driver_unregister(&vm_driver);
+    if (lb_node) {
+        device_destroy(vm_class, MKDEV(MAJOR(vm_devt), VM_LB_MINOR));
+        cdev_del(&vm_lb_cdev);
+    }
+    class_destroy(vm_class);
+    unregister_chrdev_region(vm_devt, VM_MAX_DEVICES + 1);
+}
+module_exit(vm_module_exit);
 
 // Module information for kernel module
 MODULE_DESCRIPTION("MUL MATR Kernel Module");
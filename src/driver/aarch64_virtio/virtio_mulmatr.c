@@ -0,0 +1,415 @@
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include <linux/wait.h>
+
+#define VIRTIO_ID_MULMATR   0xc1a0  // Device ID of virtio-mulmatr-device (local, not from the spec)
+#define DEVICE_NAME         "virtio_mulmatr"  // Name of the device in /dev
+#define MAX_SG              1024    // Pages a single request may span
+
+#define VMM_S_OK            0       // Request completed
+#define VMM_S_IOERR         1       // Request rejected by the device
+
+// Same call as MULMATR_GEMM of the platform driver, 'slot' must be 0
+struct mulmatr_gemm {
+    __u32 size;             // Rows and columns of A
+    __u32 k;                // Columns of B and C
+    __s32 __user *a;        // size x size
+    __s32 __user *b;        // size x k
+    __s32 __user *c;        // size x k, filled by the driver
+    __u32 slot;             // Resident matrices are not supported here, must be 0
+    __u32 pad;
+};
+
+#define MULMATR_GEMM        _IOWR('a','q',struct mulmatr_gemm)  // Run a whole GEMM
+
+// Config space of the device
+struct vmm_config {
+    __le32 max_size;
+};
+
+// Header leading the out buffers of every request
+struct vmm_hdr {
+    __le32 size;
+    __le32 k;
+    __le32 flags;           // Reserved, 0
+    __le32 reserved;
+};
+
+struct vmm_req {
+    struct vmm_hdr hdr;
+    u8 status;              // Written by the device after C
+    struct completion done;
+};
+
+struct virtio_mulmatr {
+    struct virtio_device *vdev;
+    struct virtqueue *vq;
+    spinlock_t vq_lock;             // Serializes the ring
+    wait_queue_head_t vq_wait;      // Submitters waiting for free descriptors, remove for the callers
+    bool removing;                  // Under vq_lock: nothing is queued anymore
+    u32 inflight;                   // Under vmm_dev_lock: ioctls using the device
+    u32 max_size;
+};
+
+static int major;
+static struct class *cls;
+static DEFINE_SPINLOCK(vmm_dev_lock);
+static struct virtio_mulmatr *vmm_dev;   // Device served by /dev/virtio_mulmatr
+
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+
+static struct file_operations dev_fops = {
+    .owner = THIS_MODULE,
+    .unlocked_ioctl = device_ioctl,
+};
+
+// Device for an ioctl, NULL once it is being removed; remove waits for vmm_put()
+static struct virtio_mulmatr *vmm_get(void)
+{
+    struct virtio_mulmatr *vmm;
+
+    spin_lock_irq(&vmm_dev_lock);
+    vmm = vmm_dev;
+    if (vmm)
+        vmm->inflight++;
+    spin_unlock_irq(&vmm_dev_lock);
+    return vmm;
+}
+
+static void vmm_put(struct virtio_mulmatr *vmm)
+{
+    // Woken under the lock: remove cannot free vmm before we let go of it
+    spin_lock_irq(&vmm_dev_lock);
+    if (!--vmm->inflight)
+        wake_up(&vmm->vq_wait);
+    spin_unlock_irq(&vmm_dev_lock);
+}
+
+// Pages 'len' bytes span at most, wherever they start
+static unsigned int vmm_sg_max(size_t len)
+{
+    return DIV_ROUND_UP(len, PAGE_SIZE) + 1;
+}
+
+// Pages spanned by 'len' bytes at 'buf'
+static unsigned int vmm_sg_count(const void *buf, size_t len)
+{
+    return DIV_ROUND_UP(offset_in_page(buf) + len, PAGE_SIZE);
+}
+
+// Describe 'len' bytes at 'buf' (kmalloc or vmalloc memory) page by page
+static void vmm_sg_fill(struct scatterlist *sg, unsigned int nents, void *buf, size_t len)
+{
+    unsigned int i;
+
+    sg_init_table(sg, nents);
+    for (i = 0; i < nents; i++) {
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(buf));
+        struct page *page = is_vmalloc_addr(buf) ? vmalloc_to_page(buf) : virt_to_page(buf);
+
+        sg_set_page(&sg[i], page, chunk, offset_in_page(buf));
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+// Completion callback, in interrupt context
+static void vmm_done(struct virtqueue *vq)
+{
+    struct virtio_mulmatr *vmm = vq->vdev->priv;
+    struct vmm_req *req;
+    unsigned long flags;
+    unsigned int len;
+
+    spin_lock_irqsave(&vmm->vq_lock, flags);
+    do {
+        virtqueue_disable_cb(vq);
+        while ((req = virtqueue_get_buf(vq, &len)))
+            complete(&req->done);
+    } while (!virtqueue_enable_cb(vq));
+    spin_unlock_irqrestore(&vmm->vq_lock, flags);
+
+    wake_up(&vmm->vq_wait);
+}
+
+// Queue the request, waiting for descriptors if the ring is full
+static int vmm_queue(struct virtio_mulmatr *vmm, struct scatterlist **sgs, unsigned int total,
+                     struct vmm_req *req)
+{
+    bool notify;
+    int ret;
+
+    for (;;) {
+        spin_lock_irq(&vmm->vq_lock);
+        if (vmm->removing) {
+            ret = -ENODEV;
+            break;
+        }
+        ret = virtqueue_add_sgs(vmm->vq, sgs, 2, 2, req, GFP_ATOMIC);
+        if (ret != -ENOSPC)
+            break;
+        spin_unlock_irq(&vmm->vq_lock);
+
+        // With indirect descriptors a request only takes one slot
+        wait_event(vmm->vq_wait, READ_ONCE(vmm->removing) || vmm->vq->num_free >=
+                   (virtio_has_feature(vmm->vdev, VIRTIO_RING_F_INDIRECT_DESC) ? 1 : total));
+    }
+    notify = !ret && virtqueue_kick_prepare(vmm->vq);
+    spin_unlock_irq(&vmm->vq_lock);
+
+    // The device may have suppressed notifications while it drains the ring
+    if (notify)
+        virtqueue_notify(vmm->vq);
+    return ret;
+}
+
+static long vmm_gemm(struct virtio_mulmatr *vmm, struct mulmatr_gemm __user *uarg)
+{
+    struct scatterlist hdr_sg, status_sg, *ab_sg = NULL, *c_sg;
+    struct scatterlist *sgs[4];
+    struct mulmatr_gemm req;
+    struct vmm_req *vreq;
+    unsigned int ab_nents, c_nents;
+    size_t quad, len;
+    u32 *buf;
+    int ret;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+
+    if (req.slot)
+        return -EOPNOTSUPP;
+
+    if (!req.size || req.size > vmm->max_size || !req.k || req.k > vmm->max_size)
+        return -EINVAL;
+
+    quad = (size_t)req.size * req.size;
+    len = (size_t)req.size * req.k;
+
+    // Checked before anything is allocated: A and B, C, the header and the status
+    if (vmm_sg_max(sizeof(u32) * (quad + len)) + vmm_sg_max(sizeof(u32) * len) + 2 > MAX_SG) {
+        pr_err("KERNEL vmm: %ux%u GEMM with k %u is over the %u pages of a request\n",
+               req.size, req.size, req.k, MAX_SG);
+        return -E2BIG;
+    }
+
+    // A | B | C in one buffer, the device reads A and B and writes C
+    buf = kvmalloc_array(quad + 2 * len, sizeof(u32), GFP_KERNEL);
+    vreq = kmalloc(sizeof(*vreq), GFP_KERNEL);
+    if (!buf || !vreq) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (copy_from_user(buf, req.a, sizeof(u32) * quad) ||
+        copy_from_user(buf + quad, req.b, sizeof(u32) * len)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    cpu_to_le32_array(buf, quad + len);
+
+    ab_nents = vmm_sg_count(buf, sizeof(u32) * (quad + len));
+    c_nents = vmm_sg_count(buf + quad + len, sizeof(u32) * len);
+    if (!virtio_has_feature(vmm->vdev, VIRTIO_RING_F_INDIRECT_DESC) &&
+        ab_nents + c_nents + 2 > virtqueue_get_vring_size(vmm->vq)) {
+        ret = -E2BIG;
+        goto out;
+    }
+
+    ab_sg = kmalloc_array(ab_nents + c_nents, sizeof(*ab_sg), GFP_KERNEL);
+    if (!ab_sg) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    c_sg = ab_sg + ab_nents;
+    vmm_sg_fill(ab_sg, ab_nents, buf, sizeof(u32) * (quad + len));
+    vmm_sg_fill(c_sg, c_nents, buf + quad + len, sizeof(u32) * len);
+
+    vreq->hdr.size = cpu_to_le32(req.size);
+    vreq->hdr.k = cpu_to_le32(req.k);
+    vreq->hdr.flags = 0;
+    vreq->hdr.reserved = 0;
+    vreq->status = VMM_S_IOERR;
+    init_completion(&vreq->done);
+    sg_init_one(&hdr_sg, &vreq->hdr, sizeof(vreq->hdr));
+    sg_init_one(&status_sg, &vreq->status, sizeof(vreq->status));
+
+    sgs[0] = &hdr_sg;
+    sgs[1] = ab_sg;
+    sgs[2] = c_sg;
+    sgs[3] = &status_sg;
+
+    ret = vmm_queue(vmm, sgs, ab_nents + c_nents + 2, vreq);
+    if (ret)
+        goto out;
+
+    // The device owns the buffers until it completes, the wait cannot be interrupted;
+    // remove completes the requests left in the ring with VMM_S_IOERR
+    wait_for_completion(&vreq->done);
+
+    if (vreq->status != VMM_S_OK) {
+        ret = -EIO;
+        goto out;
+    }
+
+    le32_to_cpu_array(buf + quad + len, len);
+    if (copy_to_user(req.c, buf + quad + len, sizeof(u32) * len))
+        ret = -EFAULT;
+out:
+    kfree(ab_sg);
+    kfree(vreq);
+    kvfree(buf);
+    return ret;
+}
+
+// IOCTL handler function to process custom commands sent to device
+static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct virtio_mulmatr *vmm;
+    long ret;
+
+    switch (cmd) {
+        case MULMATR_GEMM:
+            // Send A and B in one request and wait for C
+            pr_debug("KERNEL vmm: ioctl MULMATR_GEMM data\n");
+            vmm = vmm_get();
+            if (!vmm)
+                return -ENODEV;
+            ret = vmm_gemm(vmm, (struct mulmatr_gemm __user *)arg);
+            vmm_put(vmm);
+            return ret;
+
+        default:
+            pr_debug("KERNEL vmm: Error calling IOCTL cmd function\n");
+            break;
+    }
+    return -ENOTTY;
+}
+
+static int vmm_probe(struct virtio_device *vdev)
+{
+    struct virtio_mulmatr *vmm;
+    struct device *node;
+    int ret;
+
+    // Only one device is exported through /dev
+    if (vmm_dev)
+        return -EBUSY;
+
+    vmm = devm_kzalloc(&vdev->dev, sizeof(*vmm), GFP_KERNEL);
+    if (!vmm)
+        return -ENOMEM;
+
+    vmm->vdev = vdev;
+    vdev->priv = vmm;
+    spin_lock_init(&vmm->vq_lock);
+    init_waitqueue_head(&vmm->vq_wait);
+    vmm->max_size = virtio_cread32(vdev, offsetof(struct vmm_config, max_size));
+
+    vmm->vq = virtio_find_single_vq(vdev, vmm_done, "requests");
+    if (IS_ERR(vmm->vq))
+        return PTR_ERR(vmm->vq);
+
+    major = register_chrdev(0, DEVICE_NAME, &dev_fops);
+    if (major < 0) {
+        pr_alert("KERNEL vmm: Registering virtio_mulmatr device failed with %d\n", major);
+        ret = major;
+        goto err_vqs;
+    }
+
+    cls = class_create(DEVICE_NAME);
+    if (IS_ERR(cls)) {
+        ret = PTR_ERR(cls);
+        goto err_chrdev;
+    }
+    node = device_create(cls, NULL, MKDEV(major, 0), NULL, DEVICE_NAME);
+    if (IS_ERR(node)) {
+        ret = PTR_ERR(node);
+        goto err_class;
+    }
+
+    virtio_device_ready(vdev);
+    spin_lock_irq(&vmm_dev_lock);
+    vmm_dev = vmm;
+    spin_unlock_irq(&vmm_dev_lock);
+
+    pr_info("KERNEL vmm: /dev/%s ready, max size %u, requests up to %u pages\n", DEVICE_NAME,
+            vmm->max_size, MAX_SG);
+    return 0;
+
+err_class:
+    class_destroy(cls);
+err_chrdev:
+    unregister_chrdev(major, DEVICE_NAME);
+err_vqs:
+    vdev->config->del_vqs(vdev);
+    return ret;
+}
+
+static void vmm_remove(struct virtio_device *vdev)
+{
+    struct virtio_mulmatr *vmm = vdev->priv;
+    struct vmm_req *req;
+
+    // No new ioctl gets the device
+    spin_lock_irq(&vmm_dev_lock);
+    vmm_dev = NULL;
+    spin_unlock_irq(&vmm_dev_lock);
+
+    device_destroy(cls, MKDEV(major, 0));
+    class_destroy(cls);
+    unregister_chrdev(major, DEVICE_NAME);
+
+    // Nothing more is queued, then the device stops: whatever is still in
+    // the ring will never complete, its submitters get an error instead
+    spin_lock_irq(&vmm->vq_lock);
+    vmm->removing = true;
+    spin_unlock_irq(&vmm->vq_lock);
+    virtio_reset_device(vdev);
+    spin_lock_irq(&vmm->vq_lock);
+    while ((req = virtqueue_detach_unused_buf(vmm->vq))) {
+        req->status = VMM_S_IOERR;
+        complete(&req->done);
+    }
+    spin_unlock_irq(&vmm->vq_lock);
+    wake_up_all(&vmm->vq_wait);
+
+    // vmm and the queue go away with the device, the callers must be out first
+    spin_lock_irq(&vmm_dev_lock);
+    wait_event_lock_irq(vmm->vq_wait, !vmm->inflight, vmm_dev_lock);
+    spin_unlock_irq(&vmm_dev_lock);
+
+    vdev->config->del_vqs(vdev);
+
+    pr_info("KERNEL vmm: virtio_mulmatr removed\n");
+}
+
+static const struct virtio_device_id id_table[] = {
+    { VIRTIO_ID_MULMATR, VIRTIO_DEV_ANY_ID },
+    { 0 },
+};
+MODULE_DEVICE_TABLE(virtio, id_table);
+
+static struct virtio_driver vmm_driver = {
+    .driver.name = KBUILD_MODNAME,
+    .driver.owner = THIS_MODULE,
+    .id_table = id_table,
+    .probe = vmm_probe,
+    .remove = vmm_remove,
+};
+
+module_virtio_driver(vmm_driver);  // Register the virtio driver with the kernel
+
+// Module information for kernel module
+MODULE_DESCRIPTION("MUL MATR virtio Kernel Module");
+MODULE_AUTHOR("OS - Group8");
+MODULE_LICENSE("GPL");
@@ -1,44 +1,129 @@
 #include "qemu/log.h"
+#include "qapi/visitor.h"
+
+#define VIRT_MULMATR_MAX    8       // Instances, SPIs irqmap[VIRT_MULMATR] .. + 7
+#define VIRT_MULMATR_ALIGN  0x10000 // Each window starts on a 64 KiB boundary (64K page guests)
+
+static void virt_get_mulmatr_count(Object *obj, Visitor *v, const char *name,
+                                   void *opaque, Error **errp)
+{
+    VirtMachineState *vms = VIRT_MACHINE(obj);
+    uint32_t value = vms->mulmatr_count;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void virt_set_mulmatr_count(Object *obj, Visitor *v, const char *name,
+                                   void *opaque, Error **errp)
+{
+    VirtMachineState *vms = VIRT_MACHINE(obj);
+    Error *err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+    if (value < 1 || value > VIRT_MULMATR_MAX) {
+        error_setg(errp, "mulmatr-count must be between 1 and %d", VIRT_MULMATR_MAX);
+        return;
+    }
+    vms->mulmatr_count = value;
+}
+
+// Called from virt_instance_init(): -M virt,mulmatr-count=N
+static void virt_mulmatr_add_properties(Object *obj)
+{
+    VirtMachineState *vms = VIRT_MACHINE(obj);
+
+    vms->mulmatr_count = 1;
+    object_property_add(obj, "mulmatr-count", "uint32", virt_get_mulmatr_count,
+                        virt_set_mulmatr_count, NULL, NULL, NULL);
+    object_property_set_description(obj, "mulmatr-count",
+                                    "Number of virt-mulmatr instances (1 to 8)", NULL);
+}
+
+// One instance of the device at 'base', with its own SPI and FDT node
+static void create_virt_mulmatr_instance(const VirtMachineState *vms, qemu_irq *pic,
+                                         DeviceState *dev, hwaddr base, int irq)
+{
+    SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
+    hwaddr size = memory_region_size(sysbus_mmio_get_region(sbd, 0));
+    char *nodename;
+
+    sysbus_mmio_map(sbd, 0, base);
+    sysbus_connect_irq(sbd, 0, pic[irq]);
+
+    nodename = g_strdup_printf("/virt_mulmatr@%" PRIx64, base);
+
+    qemu_log_mask(CPU_LOG_MMU, "HW_ADDR %" PRIx64, base);
+    qemu_log_mask(CPU_LOG_MMU, " STR: %s\n", nodename);
+
+    qemu_fdt_add_subnode(vms->fdt, nodename);
+    qemu_fdt_setprop_string(vms->fdt, nodename, "compatible", "virt-mulmatr");
+    qemu_fdt_setprop_sized_cells(vms->fdt, nodename, "reg", 2, base, 2, size);
+    qemu_fdt_setprop_cells(vms->fdt, nodename, "interrupt-parent",
+                           vms->gic_phandle);
+    qemu_fdt_setprop_cells(vms->fdt, nodename, "interrupts",
+                           GIC_FDT_IRQ_TYPE_SPI, irq,
+                           GIC_FDT_IRQ_FLAGS_LEVEL_HI);
+
+    g_free(nodename);
+}
 
 static void create_virt_mulmatr_device(const VirtMachineState *vms, qemu_irq *pic)
 {
     qemu_log_mask(CPU_LOG_MMU, "Inside function (virt.c) create_virt_mulmatr_device ######################### QEMU #########################\n");
-    
+
     qemu_log_mask(CPU_LOG_MMU, "VIRT_MULMATR value %d\n", VIRT_MULMATR);
     qemu_log_mask(CPU_LOG_MMU, "mulmatr base (base_memmap) %"PRIx64"\n", base_memmap[VIRT_MULMATR].base);
     qemu_log_mask(CPU_LOG_MMU, "mulmatr base (ms->memmap) %"PRIx64"\n", vms->memmap[VIRT_MULMATR].base);
-    
+
     //base_memmap[VIRT_MULMATR].base;
 
     hwaddr base = vms->memmap[VIRT_MULMATR].base;
-    hwaddr size = vms->memmap[VIRT_MULMATR].size;
+    hwaddr size, stride;
     int irq = vms->irqmap[VIRT_MULMATR];
-    char *nodename;
+    DeviceState *devs[VIRT_MULMATR_MAX];
+    uint32_t i;
 
     /*
      * virt-mulmatr@0b000000 {
      *         compatible = "virt-mulmatr";
-     *         reg = <0x0b000000 0x500>;
+     *         reg = <0x0b000000 0x4000>;
      *         interrupt-parent = <&gic>;
      *         interrupts = <176>;
      * }
+     *
+     * The size of reg follows the "max-size" property of the device
+     * (e.g. -global virt-mulmatr.max-size=256). With -M virt,mulmatr-count=N
+     * instance i sits i strides (the window rounded up to 64 KiB) above the
+     * first one and raises SPI 176 + i, each with a node of its own.
      */
 
-    sysbus_create_simple("virt-mulmatr", base, pic[irq]);
+    for (i = 0; i < vms->mulmatr_count; i++) {
+        devs[i] = qdev_create(NULL, "virt-mulmatr");
+        qdev_init_nofail(devs[i]);
+    }
+    size = memory_region_size(sysbus_mmio_get_region(SYS_BUS_DEVICE(devs[0]), 0));
+    stride = ROUND_UP(size, VIRT_MULMATR_ALIGN);
 
-    nodename = g_strdup_printf("/virt_mulmatr@%" PRIx64, base);
+    // Windows too big for the low slot are moved to the high memory map
+    if (stride * vms->mulmatr_count > vms->memmap[VIRT_MULMATR].size) {
+        if (!vms->highmem ||
+            stride * vms->mulmatr_count > vms->memmap[VIRT_HIGH_MULMATR].size) {
+            error_report("virt-mulmatr: %u windows of 0x%" PRIx64 " bytes do not fit "
+                         "in the memory map, reduce max-size or mulmatr-count",
+                         vms->mulmatr_count, size);
+            exit(1);
+        }
+        base = vms->memmap[VIRT_HIGH_MULMATR].base;
+    }
 
-    qemu_log_mask(CPU_LOG_MMU, "HW_ADDR %" PRIx64, base);
-    qemu_log_mask(CPU_LOG_MMU, " STR: %s\n", nodename);
-
-    qemu_fdt_add_subnode(vms->fdt, nodename);
-    qemu_fdt_setprop_string(vms->fdt, nodename, "compatible", "virt-mulmatr");
-    qemu_fdt_setprop_sized_cells(vms->fdt, nodename, "reg", 2, base, 2, size);
-    qemu_fdt_setprop_cells(vms->fdt, nodename, "interrupt-parent",
-                           vms->gic_phandle);
-    qemu_fdt_setprop_cells(vms->fdt, nodename, "interrupts",
-                           GIC_FDT_IRQ_TYPE_SPI, irq,
-                           GIC_FDT_IRQ_FLAGS_LEVEL_HI);
-
-    g_free(nodename);
+    // Nodes are added in front of their siblings: create them backwards so that
+    // the guest finds (and numbers) the instances in address order
+    for (i = vms->mulmatr_count; i-- > 0;) {
+        create_virt_mulmatr_instance(vms, pic, devs[i], base + i * stride, irq + i);
+    }
 }
\ No newline at end of file
@@ -2,91 +2,1090 @@
 #include "qemu/log.h"
 #include "hw/hw.h"
 #include "hw/sysbus.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
 #include "qemu/bitops.h"
 #include "qemu/log.h"
+#include "qemu/bswap.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/address-spaces.h"
+#include "sysemu/dma.h"
+#include "virt_mulmatr_kernels.h"
+#include "trace.h"
 
 #define TYPE_VIRT_MULMATR          "virt-mulmatr"
 #define VIRT_MULMATR(obj)          OBJECT_CHECK(VirtMulMatrState, (obj), TYPE_VIRT_MULMATR)
 
+//window offsets of the "legacy-windows" layout (max-size <= LEGACY_MAX_SIZE), registers at 0x400
 #define MATR_A_START        0x000
-#define MATR_A_END	        0x190 	//0x000 + 100 * 4
 #define MATR_B_START        0x200
-#define MATR_B_END	        0x228 	//0x210 + 10 * 4
 #define	MATR_C_START        0x300
-#define	MATR_C_END	        0x328	//0x300 + 10 * 4
+
+//by default the windows are placed after the register page, page aligned
+#define WIN_BASE            0x1000
+#define WIN_ALIGN           0x1000
 
 #define CONTROL_REG         0x400
 #define BIT_C_ENABLE        BIT(0)
 #define BIT_C_END_OP_IRQ_EN BIT(1)
 #define BIT_C_START_OP      BIT(2)
 #define BIT_C_RESET_STAT    BIT(3)  //also reset irq
+#define BIT_C_DMA_MODE      BIT(4)  //operands/result moved through DMA_*_ADDR
+#define BIT_C_QUEUE_EN      BIT(5)  //process the submission queue, 0->1 resets it
+#define BIT_C_USE_SLOT      BIT(6)  //A is the matrix stored in slot SLOT_REG
+#define BIT_C_CNT_RESET     BIT(7)  //1 to zero the performance counters (not kept)
+#define CTRL_FMT_SHIFT      8       //bits 8-9: element format of A and B
+#define CTRL_FMT_LEN        2
+#define FMT_INT32           0       //one element per word
+#define FMT_INT16           1       //2 elements per word, element 0 in bits 0-15
+#define FMT_INT8            2       //4 elements per word, element 0 in bits 0-7
+#define BIT_C_CSR           BIT(10) //A is sparse (CSR), DMA_A_ADDR points to the row pointers
+#define BIT_C_ACCUM         BIT(11) //C = alpha x A x B + beta x C, C read back from its window/address
+#define CTRL_OP_SHIFT       12      //bits 12-13: operation
+#define CTRL_OP_LEN         2
+#define OP_GEMV             0       //C = A x b
+#define OP_GEMM             1       //C = A x B, B is size x k (DMA mode only)
+#define OP_LOAD_SLOT        2       //store A (size x size) in slot SLOT_REG
+#define OP_FREE_SLOT        3       //release slot SLOT_REG
 #define DEFAULT_CTRL_REG    0x01
 
 #define SIZE_REG            0x410
 #define DEFAULT_SIZE_REG    0x03
 
 #define STATUS_REG	        0x420
-#define BIT_S_OP_STARTED    BIT(0)
+#define BIT_S_OP_STARTED    BIT(0)  //busy, set until the worker thread is done
 #define BIT_S_OP_ENDED      BIT(1)
+#define BIT_S_DMA_ERR       BIT(2)
+#define BIT_S_CMD_ERR       BIT(3)  //invalid operation, nothing computed
+#define BIT_S_QUEUE_DONE    BIT(4)  //a batch of completions has been posted
+#define BIT_S_QUEUE_BUSY    BIT(5)  //a queued job is running, its DMA may still land
 
 #define ID_REG              0x430
 #define CHIP_ID             0xc1a0
 
-#define MAX_SIZE            10
-#define MAX_SIZE_QUAD       100
+//performance counters (readonly), 64 bit split in LO/HI words every CNT_STRIDE
+#define CNT_BASE            0x440
+#define CNT_STRIDE          0x10
+#define CNT_JOBS            0       //0x440: operations completed
+#define CNT_MACS            1       //0x450: multiply-accumulates executed
+#define CNT_WIN_RD_BYTES    2       //0x460: operand bytes the device took from the windows
+#define CNT_WIN_WR_BYTES    3       //0x470: result bytes the device stored in the window
+#define CNT_BUSY_NS         4       //0x480: virtual ns with an operation running
+#define CNT_IRQS            5       //0x490: interrupts raised
+#define CNT_NUM             6
+
+//guest-physical addresses used in DMA mode, 64 bit split in LO/HI words
+#define DMA_A_ADDR_LO       0x500
+#define DMA_A_ADDR_HI       0x504
+#define DMA_B_ADDR_LO       0x510
+#define DMA_B_ADDR_HI       0x514
+#define DMA_C_ADDR_LO       0x520
+#define DMA_C_ADDR_HI       0x524
+
+//capabilities (readonly), drivers size their transfers from these
+#define CAP_MAX_SIZE_REG    0x600
+#define CAP_MATRA_OFF_REG   0x610
+#define CAP_MATRB_OFF_REG   0x620
+#define CAP_MATRC_OFF_REG   0x630
+#define CAP_SLOTS_REG       0x640
+
+//operation parameters
+#define K_REG               0x700   //columns of B and C in GEMM mode
+#define DEFAULT_K_REG       0x01
+#define SLOT_REG            0x710   //slot used by load/free and by BIT_C_USE_SLOT
+#define ALPHA_REG           0x720   //BIT_C_ACCUM: signed scale of the product
+#define BETA_REG            0x730   //BIT_C_ACCUM: signed scale of the previous C
+#define DEFAULT_ALPHA_REG   0x01
+#define DEFAULT_BETA_REG    0x01
+
+//sparse A (BIT_C_CSR): column indexes and values in guest RAM, LO/HI words
+#define CSR_COL_ADDR_LO     0x900
+#define CSR_COL_ADDR_HI     0x904
+#define CSR_VAL_ADDR_LO     0x910
+#define CSR_VAL_ADDR_HI     0x914
+#define NNZ_REG             0x920   //stored entries of A, at most size x size
+
+//submission/completion queues in guest memory (NVMe like)
+#define SQ_BASE_LO          0x800
+#define SQ_BASE_HI          0x804
+#define CQ_BASE_LO          0x810
+#define CQ_BASE_HI          0x814
+#define Q_SIZE_REG          0x820   //entries of both queues, 2..Q_SIZE_MAX
+#define SQ_TAIL_DB          0x830   //doorbell: next free submission slot
+#define SQ_HEAD_REG         0x840   //readonly: next submission the device reads
+#define CQ_HEAD_DB          0x850   //doorbell: next completion the guest reads
+#define CQ_TAIL_REG         0x860   //readonly: next completion slot the device writes
+#define Q_SIZE_MAX          1024
+
+//submission entry, little-endian, 64 bytes
+#define SQE_SIZE            64
+#define SQE_CTRL            0x00    //operation bits, same layout as CONTROL_REG
+#define SQE_N               0x04    //matrix size
+#define SQE_K               0x08    //columns of B and C (GEMM)
+#define SQE_TAG             0x0c    //copied in the completion
+#define SQE_A_ADDR          0x10
+#define SQE_B_ADDR          0x18
+#define SQE_C_ADDR          0x20
+#define SQE_SLOT            0x28
+#define SQE_NNZ             0x2c    //CSR: stored entries, A_ADDR points to the row pointers
+#define SQE_COL_ADDR        0x30    //CSR: column indexes
+#define SQE_VAL_ADDR        0x38    //CSR: values
+#define SQE_CTRL_MASK       (MAKE_64BIT_MASK(CTRL_OP_SHIFT, CTRL_OP_LEN) | \
+                             MAKE_64BIT_MASK(CTRL_FMT_SHIFT, CTRL_FMT_LEN) | \
+                             BIT_C_USE_SLOT | BIT_C_CSR | BIT_C_ACCUM)
+
+//completion entry, little-endian, 16 bytes
+#define CQE_SIZE            16
+#define CQE_TAG             0x00
+#define CQE_STATUS          0x04    //BIT_S_OP_ENDED and the error bits of the job
+#define CQE_SQ_HEAD         0x08
+#define CQE_PHASE           0x0c    //bit 0, flips at every pass over the queue
+
+#define REG_PAGE_END        0x1000
+
+#define LEGACY_MAX_SIZE     10
+#define DEFAULT_MAX_SIZE    10
+#define MAX_SIZE_LIMIT      4096
+#define DEFAULT_SLOTS       8
+#define SLOTS_LIMIT         64
+
+//host threads computing one job, jobs below PARALLEL_MIN_MACS stay on the worker
+#define DEFAULT_COMPUTE_THREADS 1
+#define COMPUTE_THREADS_LIMIT   64
+#define PARALLEL_MIN_MACS       (1 << 20)
+#define BLOCK_ROWS_ALIGN        32      //row tile of the GEMM kernel
+
+//snapshot of the registers taken when the operation starts
+typedef struct {
+    uint32_t ctrl;
+    uint32_t size;
+    uint32_t k;
+    uint32_t tag;
+    uint32_t slot;
+    int32_t alpha;
+    int32_t beta;
+    uint64_t dma_a_addr;
+    uint64_t dma_b_addr;
+    uint64_t dma_c_addr;
+    uint32_t nnz;
+    uint64_t csr_col_addr;
+    uint64_t csr_val_addr;
+    bool dma_err;
+    bool cmd_err;
+    uint64_t macs;          //multiply-accumulates done, for the counters
+    uint64_t win_rd_bytes;  //window traffic of the job, for the counters
+    uint64_t win_wr_bytes;
+    int64_t start_ns;       //virtual time the job was issued
+    int64_t deadline_ns;    //timing model: virtual time the job completes
+} VirtMulMatrJob;
+
+//product split in row blocks, 'rowptr' set for a CSR A
+typedef struct {
+    const int32_t *a;
+    const int32_t *b;
+    int32_t *c;
+    const uint32_t *rowptr;
+    const uint32_t *colidx;
+    uint32_t n;
+    uint32_t k;
+    uint32_t block_rows;
+    uint32_t blocks;
+} VirtMulMatrTask;
 
-void matrix_vector_multiply(const int32_t *, const int32_t *, int32_t *, uint32_t);
+//matrix kept in the device across operations, only the worker thread touches it
+typedef struct {
+    int32_t *data;
+    uint32_t size;          //0 when the slot is free
+} VirtMulMatrSlot;
 
 typedef struct {
     SysBusDevice parent_obj;
     MemoryRegion iomem;
     qemu_irq irq;
 
-    int32_t matrA[MAX_SIZE_QUAD];
-	int32_t matrB[MAX_SIZE];
+    //the windows are RAM mapped over 'iomem', guest accesses to them do not trap
+    MemoryRegion win_a;
+    MemoryRegion win_b;
+    MemoryRegion win_c;
+    int32_t *matrA;
+	int32_t *matrB;
+
+	int32_t *matrC;
 
-	int32_t matrC[MAX_SIZE];
+    uint32_t max_size;      //qdev property "max-size"
+    bool legacy_windows;    //qdev property "legacy-windows": windows inside the register page
+    uint32_t matra_off;
+    uint32_t matrb_off;
+    uint32_t matrc_off;
+    uint64_t mmio_size;
 
 	uint32_t control_reg;
 	uint32_t size_reg;
 	uint32_t status_reg;
     uint32_t id_reg;
+    uint32_t k_reg;
+    int32_t alpha_reg;
+    int32_t beta_reg;
+
+    uint64_t dma_a_addr;
+    uint64_t dma_b_addr;
+    uint64_t dma_c_addr;
+    uint64_t csr_col_addr;
+    uint64_t csr_val_addr;
+    uint32_t nnz_reg;
+
+    //the operation runs on 'thread' without the BQL, 'done_bh' completes it
+    VirtMulMatrJob job;
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    bool job_pending;
+    bool stopping;
+    QEMUBH *done_bh;
+
+    //queues, protected by 'lock'; bases and size change only while disabled
+    uint64_t sq_base;
+    uint64_t cq_base;
+    uint32_t q_size;
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    bool cq_phase;
+    bool q_enabled;
+    uint32_t q_gen;         //bumped when the queues are reset
+    uint32_t q_posted;      //completions posted since the last queue IRQ
+    QEMUBH *queue_bh;
+
+    //optional timing model, completions are delayed on the virtual clock
+    uint64_t timing_setup_ns;
+    uint64_t timing_macs_per_us;
+    uint64_t timing_mb_per_s;
+    bool timing;
+    int64_t busy_until_ns;  //worker only: end of the last job in virtual time
+    QEMUTimer *done_timer;
+    QEMUTimer *queue_timer;
+    uint8_t q_cqe[CQE_SIZE];    //completion waiting for queue_timer
+    VirtMulMatrJob q_cqe_job;
+    uint32_t q_cqe_gen;
+    bool q_cqe_pending;
+    bool q_busy;            //worker is inside virt_mulmatr_queue_step(), even after a reset
+
+    //worker-owned buffers for operands fetched through DMA
+    int32_t *scratch_a;
+    int32_t *scratch_b;
+    int32_t *scratch_c;
+    int32_t *scratch_acc;   //previous C of an accumulating job
+    uint64_t scratch_a_len;
+    uint64_t scratch_bc_len;
+    uint32_t *scratch_idx;  //CSR row pointers followed by the column indexes
+    uint64_t scratch_idx_len;
+
+    //compute pool: the worker and 'compute_threads' - 1 helpers share the blocks of 'task'
+    uint32_t compute_threads;   //qdev property "compute-threads"
+    QemuThread *helpers;
+    QemuMutex pool_lock;
+    QemuCond pool_cond;         //blocks posted or pool stopping
+    QemuCond pool_done;         //last block finished
+    VirtMulMatrTask task;
+    uint32_t pool_next;         //next block to hand out
+    uint32_t pool_pending;      //blocks not finished yet
+    bool pool_stopping;
+
+    //protected by 'lock'
+    uint64_t cnt[CNT_NUM];
+    int64_t last_done_ns;   //end of the last operation, busy time is not counted twice
+
+    //device-resident matrices, 'num_slots' is the qdev property "slots"
+    VirtMulMatrSlot *slots;
+    uint32_t num_slots;
+    uint32_t slot_reg;
 
 } VirtMulMatrState;
 
-void matrix_vector_multiply(const int32_t *matrix, const int32_t *vector, int32_t *result, uint32_t size)
+static uint64_t virt_mulmatr_set_lo(uint64_t reg, uint64_t data)
+{
+    return deposit64(reg, 0, 32, data);
+}
+
+static uint64_t virt_mulmatr_set_hi(uint64_t reg, uint64_t data)
+{
+    return deposit64(reg, 32, 32, data);
+}
+
+// Bulk copy of 'count' little-endian words from guest RAM into 'dst'
+static bool virt_mulmatr_dma_read(uint64_t addr, int32_t *dst, uint32_t count)
+{
+    if (dma_memory_read(&address_space_memory, addr, dst, count * sizeof(int32_t))) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        dst[i] = le32_to_cpu(dst[i]);
+    }
+    return true;
+}
+
+// Bulk copy of 'count' words from 'buf' into guest RAM, 'buf' is made little-endian in place
+static bool virt_mulmatr_dma_write(uint64_t addr, int32_t *buf, uint32_t count)
 {
-    // Moltiplicazione matrice 'size x size' per vettore di 'size' elementi
-    for (uint32_t row = 0; row < size; row++) {
-		result[row] = 0;
-        for (uint32_t col = 0; col < size; col++) {
-            result[row] += matrix[row * size + col] * vector[col];
+    for (uint32_t i = 0; i < count; i++) {
+        buf[i] = cpu_to_le32(buf[i]);
+    }
+    return !dma_memory_write(&address_space_memory, addr, buf, count * sizeof(int32_t));
+}
+
+// Bytes per element of A and B for the format in 'ctrl', 0 if the format is reserved
+static unsigned virt_mulmatr_fmt_bytes(uint32_t ctrl)
+{
+    switch (extract32(ctrl, CTRL_FMT_SHIFT, CTRL_FMT_LEN)) {
+    case FMT_INT32:
+        return 4;
+    case FMT_INT16:
+        return 2;
+    case FMT_INT8:
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sign-extend 'count' elements of 'esize' bytes packed in the first words of
+ * 'buf' to one element per word. Walking backwards the packed word of an
+ * element is always read before its slot is overwritten.
+ */
+static void virt_mulmatr_unpack(int32_t *buf, uint64_t count, unsigned esize)
+{
+    unsigned per_word = 4 / esize;
+
+    if (esize == 4) {
+        return;
+    }
+    for (uint64_t i = count; i-- > 0;) {
+        buf[i] = sextract32(buf[i / per_word], 8 * esize * (i % per_word), 8 * esize);
+    }
+}
+
+// Read an operand of 'count' elements from guest RAM or from the window 'win' and unpack it in 'dst'
+static bool virt_mulmatr_fetch(int32_t *dst, bool dma, uint64_t addr, const int32_t *win,
+                               uint64_t count, unsigned esize)
+{
+    uint64_t words = DIV_ROUND_UP(count * esize, 4);
+
+    if (dma) {
+        if (!virt_mulmatr_dma_read(addr, dst, words)) {
+            return false;
+        }
+    } else {
+        // the windows hold what the guest stored, little-endian like its RAM
+        for (uint64_t i = 0; i < words; i++) {
+            dst[i] = le32_to_cpu(win[i]);
         }
     }
+    virt_mulmatr_unpack(dst, count, esize);
+    return true;
 }
 
-static uint64_t virt_mulmatr_read(void *opaque, hwaddr offset, unsigned size)
+// Grow the scratch buffers, only the worker thread uses them
+static void virt_mulmatr_scratch(VirtMulMatrState *s, uint64_t a_len, uint64_t bc_len)
 {
-    qemu_log_mask(CPU_LOG_MMU, "QEMU: Inside function (virt_mulmatr.c) virt_mulmatr_read. Reading on addr 0x%x\n", (uint32_t)offset);
+    if (a_len > s->scratch_a_len) {
+        s->scratch_a = g_renew(int32_t, s->scratch_a, a_len);
+        s->scratch_a_len = a_len;
+    }
+    if (bc_len > s->scratch_bc_len) {
+        s->scratch_b = g_renew(int32_t, s->scratch_b, bc_len);
+        s->scratch_c = g_renew(int32_t, s->scratch_c, bc_len);
+        s->scratch_acc = g_renew(int32_t, s->scratch_acc, bc_len);
+        s->scratch_bc_len = bc_len;
+    }
+}
 
-    VirtMulMatrState *s = (VirtMulMatrState *)opaque;
+/*
+ * c = alpha * c + beta * C, C being what the window or DMA_C_addr holds before
+ * the job stores its result. Arithmetic wraps around on 32 bit like the kernels.
+ */
+static bool virt_mulmatr_accumulate(VirtMulMatrState *s, VirtMulMatrJob *job, int32_t *c,
+                                    uint64_t count)
+{
+    bool dma = job->ctrl & BIT_C_DMA_MODE;
+    int32_t *prev = s->scratch_acc;
+
+    if (!virt_mulmatr_fetch(prev, dma, job->dma_c_addr, s->matrC, count, sizeof(int32_t))) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: DMA read of C to accumulate failed\n");
+        job->dma_err = true;
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        c[i] = (uint32_t)job->alpha * (uint32_t)c[i] + (uint32_t)job->beta * (uint32_t)prev[i];
+    }
+    if (!dma) {
+        job->win_rd_bytes += count * sizeof(int32_t);
+    }
+    return true;
+}
+
+static void virt_mulmatr_task_block(const VirtMulMatrTask *task, uint32_t idx)
+{
+    uint32_t row0 = idx * task->block_rows;
+    uint32_t rows = MIN(task->block_rows, task->n - row0);
+    int32_t *c = task->c + (size_t)row0 * task->k;
+
+    if (task->rowptr) {
+        matrix_sparse_multiply(task->rowptr + row0, task->colidx, task->a, task->b, c,
+                               rows, task->k);
+    } else {
+        matrix_block_multiply(task->a + (size_t)row0 * task->n, task->b, c, rows,
+                              task->n, task->k);
+    }
+}
+
+// Compute blocks until none is left to hand out, called with 'pool_lock' held
+static void virt_mulmatr_pool_work(VirtMulMatrState *s)
+{
+    while (s->pool_next < s->task.blocks) {
+        uint32_t idx = s->pool_next++;
+
+        qemu_mutex_unlock(&s->pool_lock);
+        virt_mulmatr_task_block(&s->task, idx);
+        qemu_mutex_lock(&s->pool_lock);
+
+        if (--s->pool_pending == 0) {
+            qemu_cond_signal(&s->pool_done);
+        }
+    }
+}
+
+static void *virt_mulmatr_helper(void *opaque)
+{
+    VirtMulMatrState *s = opaque;
+
+    qemu_mutex_lock(&s->pool_lock);
+    while (!s->pool_stopping) {
+        if (s->pool_next < s->task.blocks) {
+            virt_mulmatr_pool_work(s);
+        } else {
+            qemu_cond_wait(&s->pool_cond, &s->pool_lock);
+        }
+    }
+    qemu_mutex_unlock(&s->pool_lock);
+    return NULL;
+}
+
+/*
+ * Runs the product of 'task' on the worker thread. Big products are split in
+ * row blocks computed by the worker and the helpers together; the function
+ * returns, and the job completes, only once every block is done.
+ */
+static void virt_mulmatr_compute(VirtMulMatrState *s, VirtMulMatrTask *task, uint64_t macs)
+{
+    uint32_t parts = MIN(s->compute_threads, DIV_ROUND_UP(task->n, BLOCK_ROWS_ALIGN));
+
+    if (parts <= 1 || macs < PARALLEL_MIN_MACS) {
+        task->block_rows = task->n;
+        task->blocks = 1;
+        virt_mulmatr_task_block(task, 0);
+        return;
+    }
+    task->block_rows = ROUND_UP(DIV_ROUND_UP(task->n, parts), BLOCK_ROWS_ALIGN);
+    task->blocks = DIV_ROUND_UP(task->n, task->block_rows);
+
+    qemu_mutex_lock(&s->pool_lock);
+    s->task = *task;
+    s->pool_next = 0;
+    s->pool_pending = task->blocks;
+    qemu_cond_broadcast(&s->pool_cond);
+
+    virt_mulmatr_pool_work(s);
+    while (s->pool_pending) {
+        qemu_cond_wait(&s->pool_done, &s->pool_lock);
+    }
+    qemu_mutex_unlock(&s->pool_lock);
+}
+
+// Sparse job: only the nnz stored entries of A are fetched and multiplied
+static void virt_mulmatr_run_csr(VirtMulMatrState *s, VirtMulMatrJob *job, uint32_t n, uint32_t k,
+                                 unsigned esize)
+{
+    uint64_t nnz = job->nnz;
+    uint32_t *rowptr, *colidx;
+
+    if (nnz > (uint64_t)n * n) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: %u entries do not fit a %ux%u matrix\n",
+                      job->nnz, n, n);
+        job->cmd_err = true;
+        return;
+    }
+
+    virt_mulmatr_scratch(s, nnz, (uint64_t)n * k);
+    if (n + 1 + nnz > s->scratch_idx_len) {
+        s->scratch_idx = g_renew(uint32_t, s->scratch_idx, n + 1 + nnz);
+        s->scratch_idx_len = n + 1 + nnz;
+    }
+    rowptr = s->scratch_idx;
+    colidx = rowptr + n + 1;
+
+    if (!virt_mulmatr_dma_read(job->dma_a_addr, (int32_t *)rowptr, n + 1) ||
+        !virt_mulmatr_dma_read(job->csr_col_addr, (int32_t *)colidx, nnz) ||
+        !virt_mulmatr_fetch(s->scratch_a, true, job->csr_val_addr, NULL, nnz, esize) ||
+        !virt_mulmatr_fetch(s->scratch_b, true, job->dma_b_addr, NULL, (uint64_t)n * k, esize)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: DMA read of CSR operands failed\n");
+        job->dma_err = true;
+        return;
+    }
+
+    // the kernel trusts the indexes, anything out of range is refused here
+    for (uint32_t i = 0; i < n; i++) {
+        if (rowptr[i] > rowptr[i + 1]) {
+            job->cmd_err = true;
+        }
+    }
+    for (uint64_t e = 0; e < nnz; e++) {
+        if (colidx[e] >= n) {
+            job->cmd_err = true;
+        }
+    }
+    if (rowptr[0] != 0 || rowptr[n] != nnz || job->cmd_err) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: malformed CSR matrix\n");
+        job->cmd_err = true;
+        return;
+    }
+
+    job->macs = nnz * k;
+    virt_mulmatr_compute(s, &(VirtMulMatrTask) {
+                             .a = s->scratch_a, .b = s->scratch_b, .c = s->scratch_c,
+                             .rowptr = rowptr, .colidx = colidx, .n = n, .k = k,
+                         }, job->macs);
+
+    if ((job->ctrl & BIT_C_ACCUM) && !virt_mulmatr_accumulate(s, job, s->scratch_c, (uint64_t)n * k)) {
+        return;
+    }
+
+    if (!virt_mulmatr_dma_write(job->dma_c_addr, s->scratch_c, n * k)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: DMA write of result failed\n");
+        job->dma_err = true;
+    }
+}
+
+// Load or free a slot; a load reads A like a multiplication would (window or DMA)
+static void virt_mulmatr_run_slot(VirtMulMatrState *s, VirtMulMatrJob *job, uint32_t op)
+{
+    VirtMulMatrSlot *slot = &s->slots[job->slot];
+    uint64_t quad = (uint64_t)job->size * job->size;
+
+    if (op == OP_FREE_SLOT) {
+        g_free(slot->data);
+        slot->data = NULL;
+        slot->size = 0;
+        return;
+    }
+
+    if (quad > (uint64_t)slot->size * slot->size) {
+        slot->data = g_renew(int32_t, slot->data, quad);
+    }
+    slot->size = 0;
+
+    if (!virt_mulmatr_fetch(slot->data, job->ctrl & BIT_C_DMA_MODE, job->dma_a_addr, s->matrA,
+                            quad, virt_mulmatr_fmt_bytes(job->ctrl))) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: DMA read of slot %u failed\n", job->slot);
+        job->dma_err = true;
+        return;
+    }
+    if (!(job->ctrl & BIT_C_DMA_MODE)) {
+        job->win_rd_bytes = DIV_ROUND_UP(quad * virt_mulmatr_fmt_bytes(job->ctrl), 4) * 4;
+    }
+    slot->size = job->size;
+}
+
+/*
+ * Runs on the worker thread: only 'job' and the buffers it computes on are
+ * touched. Operands are copied from the windows or guest RAM to the scratch
+ * buffers, the guest may rewrite the windows as soon as the job completes.
+ */
+
+static void virt_mulmatr_run(VirtMulMatrState *s, VirtMulMatrJob *job)
+{
+    uint32_t op = extract32(job->ctrl, CTRL_OP_SHIFT, CTRL_OP_LEN);
+    bool dma = job->ctrl & BIT_C_DMA_MODE;
+    uint32_t n = job->size;
+    uint32_t k = (op == OP_GEMM) ? job->k : 1;
+    bool use_slot = job->ctrl & BIT_C_USE_SLOT;
+    unsigned esize = virt_mulmatr_fmt_bytes(job->ctrl);
+    int32_t *a, *b, *c;
+
+    if (!esize) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: reserved data format\n");
+        job->cmd_err = true;
+        return;
+    }
+
+    // a sparse A is only read through DMA and never stored in a slot
+    if ((job->ctrl & BIT_C_CSR) && (!dma || use_slot || op == OP_LOAD_SLOT || op == OP_FREE_SLOT)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: CSR requires DMA mode and no slot\n");
+        job->cmd_err = true;
+        return;
+    }
+    if ((use_slot || op == OP_LOAD_SLOT || op == OP_FREE_SLOT) && job->slot >= s->num_slots) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: slot %u out of range\n", job->slot);
+        job->cmd_err = true;
+        return;
+    }
+    if (op == OP_LOAD_SLOT || op == OP_FREE_SLOT) {
+        virt_mulmatr_run_slot(s, job, op);
+        return;
+    }
+    if (use_slot && s->slots[job->slot].size != n) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: slot %u does not hold a %ux%u matrix\n",
+                      job->slot, n, n);
+        job->cmd_err = true;
+        return;
+    }
+    // B and C of a GEMM do not fit the vector windows, they only travel through DMA
+    if (op == OP_GEMM && !dma) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: GEMM requires DMA mode\n");
+        job->cmd_err = true;
+        return;
+    }
+
+    if (job->ctrl & BIT_C_CSR) {
+        virt_mulmatr_run_csr(s, job, n, k, esize);
+        return;
+    }
+
+    // A coming from a slot is not transferred at all
+    virt_mulmatr_scratch(s, use_slot ? 0 : (uint64_t)n * n, (uint64_t)n * k);
+    a = s->scratch_a;
+    b = s->scratch_b;
+    c = s->scratch_c;
+
+    if ((!use_slot &&
+         !virt_mulmatr_fetch(a, dma, job->dma_a_addr, s->matrA, (uint64_t)n * n, esize)) ||
+        !virt_mulmatr_fetch(b, dma, job->dma_b_addr, s->matrB, (uint64_t)n * k, esize)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: DMA read of operands failed\n");
+        job->dma_err = true;
+        return;
+    }
+    if (use_slot) {
+        a = s->slots[job->slot].data;
+    }
+
+    job->macs = (uint64_t)n * n * k;
+    virt_mulmatr_compute(s, &(VirtMulMatrTask) { .a = a, .b = b, .c = c, .n = n, .k = k },
+                         job->macs);
+
+    if ((job->ctrl & BIT_C_ACCUM) && !virt_mulmatr_accumulate(s, job, c, (uint64_t)n * k)) {
+        return;
+    }
+
+    if (!dma) {
+        // window jobs are GEMV only, k is 1
+        for (uint32_t i = 0; i < n; i++) {
+            s->matrC[i] = cpu_to_le32(c[i]);
+        }
+        job->win_rd_bytes += DIV_ROUND_UP((use_slot ? 0 : (uint64_t)n * n) * esize, 4) * 4 +
+                            DIV_ROUND_UP((uint64_t)n * esize, 4) * 4;
+        job->win_wr_bytes = (uint64_t)n * sizeof(int32_t);
+    } else if (!virt_mulmatr_dma_write(job->dma_c_addr, c, n * k)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: DMA write of result failed\n");
+        job->dma_err = true;
+    }
+}
+
+// Decode a submission entry into 'job', operands always travel through DMA
+static void virt_mulmatr_parse_sqe(VirtMulMatrState *s, const uint8_t *sqe, VirtMulMatrJob *job)
+{
+    uint32_t op;
+
+    job->ctrl = (ldl_le_p(sqe + SQE_CTRL) & SQE_CTRL_MASK) | BIT_C_DMA_MODE;
+    job->size = ldl_le_p(sqe + SQE_N);
+    job->k = ldl_le_p(sqe + SQE_K);
+    job->tag = ldl_le_p(sqe + SQE_TAG);
+    job->dma_a_addr = ldq_le_p(sqe + SQE_A_ADDR);
+    job->dma_b_addr = ldq_le_p(sqe + SQE_B_ADDR);
+    job->dma_c_addr = ldq_le_p(sqe + SQE_C_ADDR);
+    job->slot = ldl_le_p(sqe + SQE_SLOT);
+    job->alpha = 1;     //no room in the entry, queued jobs accumulate unscaled
+    job->beta = 1;
+    job->nnz = ldl_le_p(sqe + SQE_NNZ);
+    job->csr_col_addr = ldq_le_p(sqe + SQE_COL_ADDR);
+    job->csr_val_addr = ldq_le_p(sqe + SQE_VAL_ADDR);
+
+    op = extract32(job->ctrl, CTRL_OP_SHIFT, CTRL_OP_LEN);
+    if ((op != OP_FREE_SLOT && (job->size == 0 || job->size > s->max_size)) ||
+        (op == OP_GEMM && (job->k == 0 || job->k > s->max_size))) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: bad submission size %u k %u\n",
+                      job->size, job->k);
+        job->cmd_err = true;
+    }
+}
+
+// Virtual time a job keeps the device busy, from the "timing-*" properties
+static int64_t virt_mulmatr_job_ns(VirtMulMatrState *s, const VirtMulMatrJob *job)
+{
+    uint32_t op = extract32(job->ctrl, CTRL_OP_SHIFT, CTRL_OP_LEN);
+    uint64_t n = job->size;
+    uint64_t k = (op == OP_GEMM) ? job->k : 1;
+    uint64_t macs = 0, bytes = 0;
+    uint64_t esize = virt_mulmatr_fmt_bytes(job->ctrl);
+    int64_t ns = s->timing_setup_ns;
+
+    if (job->cmd_err) {
+        return ns;
+    }
+
+    if ((op == OP_GEMV || op == OP_GEMM) && (job->ctrl & BIT_C_CSR)) {
+        // row pointers and column indexes are 32 bit, the values packed like B
+        macs = job->nnz * k;
+        bytes = (n + 1 + job->nnz) * sizeof(int32_t) + job->nnz * esize +
+                n * k * (esize + sizeof(int32_t));
+    } else if (op == OP_GEMV || op == OP_GEMM) {
+        macs = n * n * k;
+        // B moves packed, C is always 32 bit
+        bytes = n * k * (esize + sizeof(int32_t));
+        if (!(job->ctrl & BIT_C_USE_SLOT)) {
+            bytes += n * n * esize;
+        }
+    } else if (op == OP_LOAD_SLOT) {
+        bytes = n * n * esize;
+    }
+
+    // an accumulating job reads C back before writing it
+    if (macs && (job->ctrl & BIT_C_ACCUM)) {
+        bytes += n * k * sizeof(int32_t);
+    }
+
+    if (s->timing_macs_per_us) {
+        ns += macs * 1000 / s->timing_macs_per_us;
+    }
+    if (s->timing_mb_per_s) {
+        ns += bytes * 1000 / s->timing_mb_per_s;    //1 MB/s = 1 byte/us
+    }
+    return ns;
+}
+
+// Worker thread: jobs run back to back in virtual time, none starts before it is issued
+static int64_t virt_mulmatr_deadline(VirtMulMatrState *s, const VirtMulMatrJob *job)
+{
+    s->busy_until_ns = MAX(job->start_ns, s->busy_until_ns) + virt_mulmatr_job_ns(s, job);
+    return s->busy_until_ns;
+}
+
+// Count a finished job, called with 'lock' held
+static void virt_mulmatr_account(VirtMulMatrState *s, const VirtMulMatrJob *job)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    trace_virt_mulmatr_job_end(job->size, job->k, job->macs, job->dma_err || job->cmd_err,
+                               now - job->start_ns);
+    s->cnt[CNT_JOBS]++;
+    s->cnt[CNT_MACS] += job->macs;
+    s->cnt[CNT_WIN_RD_BYTES] += job->win_rd_bytes;
+    s->cnt[CNT_WIN_WR_BYTES] += job->win_wr_bytes;
+    s->cnt[CNT_BUSY_NS] += MAX(now - MAX(job->start_ns, s->last_done_ns), 0);
+    s->last_done_ns = now;
+}
+
+// Publish a completion at cq_tail and advance the pointers, called with 'lock' held
+static void virt_mulmatr_queue_post(VirtMulMatrState *s, const uint8_t *cqe,
+                                    const VirtMulMatrJob *job)
+{
+    uint64_t cqe_addr = s->cq_base + (uint64_t)s->cq_tail * CQE_SIZE;
+
+    if (dma_memory_write(&address_space_memory, cqe_addr, cqe, CQE_SIZE)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: DMA write of completion failed\n");
+    }
+    virt_mulmatr_account(s, job);
+    s->sq_head = ldl_le_p(cqe + CQE_SQ_HEAD);
+    if (++s->cq_tail == s->q_size) {
+        s->cq_tail = 0;
+        s->cq_phase = !s->cq_phase;
+    }
+    // Half a ring completed: interrupt now so the guest refills while we run
+    if (++s->q_posted >= s->q_size / 2) {
+        s->q_posted = 0;
+        qemu_bh_schedule(s->queue_bh);
+    }
+}
+
+// Called with 'lock' held: there is a submission and room for its completion
+static bool virt_mulmatr_queue_ready(VirtMulMatrState *s)
+{
+    return s->q_enabled && s->sq_head != s->sq_tail &&
+           (s->cq_tail + 1) % s->q_size != s->cq_head;
+}
+
+// Fetch, run and complete the submission at sq_head; 'lock' is dropped meanwhile
+static void virt_mulmatr_queue_step(VirtMulMatrState *s)
+{
+    uint32_t gen = s->q_gen;
+    uint32_t next_head = (s->sq_head + 1) % s->q_size;
+    uint64_t sqe_addr = s->sq_base + (uint64_t)s->sq_head * SQE_SIZE;
+    bool phase = s->cq_phase;
+    uint8_t sqe[SQE_SIZE];
+    uint8_t cqe[CQE_SIZE];
+    VirtMulMatrJob job = { 0 };
+    uint32_t status = BIT_S_OP_ENDED;
+
+    qemu_mutex_unlock(&s->lock);
+
+    job.start_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    if (dma_memory_read(&address_space_memory, sqe_addr, sqe, SQE_SIZE)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: DMA read of submission failed\n");
+        job.dma_err = true;
+    } else {
+        virt_mulmatr_parse_sqe(s, sqe, &job);
+        trace_virt_mulmatr_job_start(job.ctrl, job.size, job.k, true);
+        if (!job.cmd_err) {
+            virt_mulmatr_run(s, &job);
+        }
+    }
+    status |= (job.dma_err ? BIT_S_DMA_ERR : 0) | (job.cmd_err ? BIT_S_CMD_ERR : 0);
+
+    stl_le_p(cqe + CQE_TAG, job.tag);
+    stl_le_p(cqe + CQE_STATUS, status);
+    stl_le_p(cqe + CQE_SQ_HEAD, next_head);
+    stl_le_p(cqe + CQE_PHASE, phase);
+
+    qemu_mutex_lock(&s->lock);
+
+    // The queues were reset while the job ran, its slots are gone
+    if (gen != s->q_gen) {
+        return;
+    }
+    if (!s->timing) {
+        virt_mulmatr_queue_post(s, cqe, &job);
+        return;
+    }
+
+    // The completion shows up when the job ends in virtual time, the next one waits for it
+    memcpy(s->q_cqe, cqe, CQE_SIZE);
+    s->q_cqe_job = job;
+    s->q_cqe_gen = gen;
+    s->q_cqe_pending = true;
+    timer_mod(s->queue_timer, virt_mulmatr_deadline(s, &job));
+    while (s->q_cqe_pending && gen == s->q_gen && !s->stopping) {
+        qemu_cond_wait(&s->cond, &s->lock);
+    }
+}
+
+// Timing model: the queued job at the head has ended
+static void virt_mulmatr_queue_timer(void *opaque)
+{
+    VirtMulMatrState *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    if (s->q_cqe_pending && s->q_cqe_gen == s->q_gen) {
+        virt_mulmatr_queue_post(s, s->q_cqe, &s->q_cqe_job);
+    }
+    s->q_cqe_pending = false;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+}
+
+static void *virt_mulmatr_worker(void *opaque)
+{
+    VirtMulMatrState *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    while (!s->stopping) {
+        if (s->job_pending) {
+            s->job_pending = false;
+            qemu_mutex_unlock(&s->lock);
+
+            virt_mulmatr_run(s, &s->job);
+            if (s->timing) {
+                s->job.deadline_ns = virt_mulmatr_deadline(s, &s->job);
+            }
+            qemu_bh_schedule(s->done_bh);
+
+            qemu_mutex_lock(&s->lock);
+        } else if (virt_mulmatr_queue_ready(s)) {
+            s->q_busy = true;
+            virt_mulmatr_queue_step(s);
+            s->q_busy = false;
+        } else {
+            // Out of submissions (or of completion slots): one IRQ for the batch
+            if (s->q_posted) {
+                s->q_posted = 0;
+                qemu_bh_schedule(s->queue_bh);
+            }
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void virt_mulmatr_set_irq(VirtMulMatrState *s, int level)
+{
+    trace_virt_mulmatr_irq(level);
+    qemu_set_irq(s->irq, level);
+}
+
+static void virt_mulmatr_raise_irq(VirtMulMatrState *s)
+{
+    qemu_mutex_lock(&s->lock);
+    s->cnt[CNT_IRQS]++;
+    qemu_mutex_unlock(&s->lock);
+
+    virt_mulmatr_set_irq(s, 1);
+}
+
+// End of the register-started operation, runs in the main loop with the BQL held
+static void virt_mulmatr_done(void *opaque)
+{
+    VirtMulMatrState *s = opaque;
+
+    qemu_mutex_lock(&s->lock);
+    virt_mulmatr_account(s, &s->job);
+    qemu_mutex_unlock(&s->lock);
+
+    s->status_reg &= ~BIT_S_OP_STARTED;
+    s->status_reg |= BIT_S_OP_ENDED; //bit 1 = 1 Operation Ended
+    if (s->job.dma_err) {
+        s->status_reg |= BIT_S_DMA_ERR;
+    }
+    if (s->job.cmd_err) {
+        s->status_reg |= BIT_S_CMD_ERR;
+    }
+
+    if(s->control_reg & BIT_C_END_OP_IRQ_EN)
+        virt_mulmatr_raise_irq(s);
+}
+
+// Bottom half, the worker is done: complete now or when the timing model says so
+static void virt_mulmatr_done_bh(void *opaque)
+{
+    VirtMulMatrState *s = opaque;
+
+    if (s->timing) {
+        timer_mod(s->done_timer, s->job.deadline_ns);
+    } else {
+        virt_mulmatr_done(s);
+    }
+}
+
+// Bottom half for a batch of queue completions
+static void virt_mulmatr_queue_bh(void *opaque)
+{
+    VirtMulMatrState *s = opaque;
+
+    s->status_reg |= BIT_S_QUEUE_DONE;
+
+    if(s->control_reg & BIT_C_END_OP_IRQ_EN)
+        virt_mulmatr_raise_irq(s);
+}
+
+// Enabling the queues resets heads, tails and phase
+static void virt_mulmatr_queue_enable(VirtMulMatrState *s, bool enable)
+{
+    if (enable && (s->q_size < 2 || s->q_size > Q_SIZE_MAX)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: queue size %u not valid\n", s->q_size);
+        enable = false;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    if (enable) {
+        s->sq_head = s->sq_tail = 0;
+        s->cq_head = s->cq_tail = 0;
+        s->cq_phase = true;
+        s->q_posted = 0;
+        s->q_cqe_pending = false;
+        s->q_gen++;
+    }
+    s->q_enabled = enable;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+}
+
+// Doorbells move one of the guest-owned indexes and wake the worker
+static void virt_mulmatr_doorbell(VirtMulMatrState *s, uint32_t *index, uint64_t data)
+{
+    qemu_mutex_lock(&s->lock);
+    if (!s->q_enabled || data >= s->q_size) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: doorbell value %u ignored\n", (uint32_t)data);
+    } else {
+        *index = data;
+        qemu_cond_signal(&s->cond);
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+static uint32_t virt_mulmatr_queue_index(VirtMulMatrState *s, uint32_t *index)
+{
+    uint32_t val;
+
+    qemu_mutex_lock(&s->lock);
+    val = *index;
+    qemu_mutex_unlock(&s->lock);
+    return val;
+}
+
+static uint32_t virt_mulmatr_counter(VirtMulMatrState *s, hwaddr offset)
+{
+    uint64_t val;
+
+    qemu_mutex_lock(&s->lock);
+    val = s->cnt[(offset - CNT_BASE) / CNT_STRIDE];
+    qemu_mutex_unlock(&s->lock);
+
+    return extract64(val, (offset & 4) ? 32 : 0, 32);
+}
+
+static void virt_mulmatr_counters_reset(VirtMulMatrState *s)
+{
+    qemu_mutex_lock(&s->lock);
+    memset(s->cnt, 0, sizeof(s->cnt));
+    s->last_done_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    qemu_mutex_unlock(&s->lock);
+}
+
+static void virt_mulmatr_start(VirtMulMatrState *s)
+{
+    if (s->status_reg & BIT_S_OP_STARTED) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: start ignored, device busy\n");
+        return;
+    }
+
+    s->job.ctrl = s->control_reg;
+    s->job.size = s->size_reg;
+    s->job.k = s->k_reg;
+    s->job.slot = s->slot_reg;
+    s->job.alpha = s->alpha_reg;
+    s->job.beta = s->beta_reg;
+    s->job.dma_a_addr = s->dma_a_addr;
+    s->job.dma_b_addr = s->dma_b_addr;
+    s->job.dma_c_addr = s->dma_c_addr;
+    s->job.nnz = s->nnz_reg;
+    s->job.csr_col_addr = s->csr_col_addr;
+    s->job.csr_val_addr = s->csr_val_addr;
+    s->job.dma_err = false;
+    s->job.cmd_err = false;
+    s->job.macs = 0;
+    s->job.win_rd_bytes = 0;
+    s->job.win_wr_bytes = 0;
+    s->job.start_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    trace_virt_mulmatr_job_start(s->job.ctrl, s->job.size, s->job.k, false);
+
+    s->status_reg = BIT_S_OP_STARTED; //bit 0 = 1 Operation In progress
+
+    qemu_mutex_lock(&s->lock);
+    s->job_pending = true;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+}
+
+static uint64_t virt_mulmatr_reg_read(VirtMulMatrState *s, hwaddr offset)
+{
     bool is_enabled = s->control_reg & BIT_C_ENABLE;
 
     if (!is_enabled) {
-        qemu_log_mask(CPU_LOG_MMU, "Device is disabled\n");
         return 0;
     }
 
-    if((int)offset >= MATR_A_START && (int)offset <= MATR_A_END && ((int)offset%4 == 0))
-	{
-		return s->matrA[((int)offset-MATR_A_START)/4];
-	} else if((int)offset >= MATR_B_START && (int)offset <= MATR_B_END && ((int)offset%4 == 0))
-	{
-		return s->matrB[((int)offset-MATR_B_START)/4];
-	} else if((int)offset >= MATR_C_START && (int)offset <= MATR_C_END && ((int)offset%4 == 0))
-	{
-		return s->matrC[((int)offset-MATR_C_START)/4];
-	} else if((int)offset == CONTROL_REG)
+    if((int)offset == CONTROL_REG)
 	{
 		return s->control_reg;
 	} else if((int)offset == SIZE_REG)
@@ -94,49 +1093,233 @@ static uint64_t virt_mulmatr_read(void *opaque, hwaddr offset, unsigned size)
 		return s->size_reg;
 	}else if((int)offset == STATUS_REG)
 	{
-        qemu_set_irq(s->irq, 0);
-		return s->status_reg;
+        uint32_t status = s->status_reg;
+
+        virt_mulmatr_set_irq(s, 0);
+        qemu_mutex_lock(&s->lock);
+        if (s->q_busy) {
+            status |= BIT_S_QUEUE_BUSY;
+        }
+        qemu_mutex_unlock(&s->lock);
+		return status;
 	}else if((int)offset == ID_REG)
 	{
 		return s->id_reg;
+	}else if((int)offset >= CNT_BASE && (int)offset < CNT_BASE + CNT_NUM * CNT_STRIDE &&
+	         !(offset & (CNT_STRIDE - 1) & ~4))
+	{
+		return virt_mulmatr_counter(s, offset);
+	}else if((int)offset == K_REG)
+	{
+		return s->k_reg;
+	}else if((int)offset == SLOT_REG)
+	{
+		return s->slot_reg;
+	}else if((int)offset == ALPHA_REG)
+	{
+		return (uint32_t)s->alpha_reg;
+	}else if((int)offset == BETA_REG)
+	{
+		return (uint32_t)s->beta_reg;
+	}else if((int)offset == SQ_BASE_LO)
+	{
+		return extract64(s->sq_base, 0, 32);
+	}else if((int)offset == SQ_BASE_HI)
+	{
+		return extract64(s->sq_base, 32, 32);
+	}else if((int)offset == CQ_BASE_LO)
+	{
+		return extract64(s->cq_base, 0, 32);
+	}else if((int)offset == CQ_BASE_HI)
+	{
+		return extract64(s->cq_base, 32, 32);
+	}else if((int)offset == Q_SIZE_REG)
+	{
+		return s->q_size;
+	}else if((int)offset == SQ_TAIL_DB)
+	{
+		return virt_mulmatr_queue_index(s, &s->sq_tail);
+	}else if((int)offset == SQ_HEAD_REG)
+	{
+		return virt_mulmatr_queue_index(s, &s->sq_head);
+	}else if((int)offset == CQ_HEAD_DB)
+	{
+		return virt_mulmatr_queue_index(s, &s->cq_head);
+	}else if((int)offset == CQ_TAIL_REG)
+	{
+		return virt_mulmatr_queue_index(s, &s->cq_tail);
+	}else if((int)offset == CAP_MAX_SIZE_REG)
+	{
+		return s->max_size;
+	}else if((int)offset == CAP_MATRA_OFF_REG)
+	{
+		return s->matra_off;
+	}else if((int)offset == CAP_MATRB_OFF_REG)
+	{
+		return s->matrb_off;
+	}else if((int)offset == CAP_MATRC_OFF_REG)
+	{
+		return s->matrc_off;
+	}else if((int)offset == CAP_SLOTS_REG)
+	{
+		return s->num_slots;
+	}else if((int)offset == DMA_A_ADDR_LO)
+	{
+		return extract64(s->dma_a_addr, 0, 32);
+	}else if((int)offset == DMA_A_ADDR_HI)
+	{
+		return extract64(s->dma_a_addr, 32, 32);
+	}else if((int)offset == DMA_B_ADDR_LO)
+	{
+		return extract64(s->dma_b_addr, 0, 32);
+	}else if((int)offset == DMA_B_ADDR_HI)
+	{
+		return extract64(s->dma_b_addr, 32, 32);
+	}else if((int)offset == DMA_C_ADDR_LO)
+	{
+		return extract64(s->dma_c_addr, 0, 32);
+	}else if((int)offset == DMA_C_ADDR_HI)
+	{
+		return extract64(s->dma_c_addr, 32, 32);
+	}else if((int)offset == CSR_COL_ADDR_LO)
+	{
+		return extract64(s->csr_col_addr, 0, 32);
+	}else if((int)offset == CSR_COL_ADDR_HI)
+	{
+		return extract64(s->csr_col_addr, 32, 32);
+	}else if((int)offset == CSR_VAL_ADDR_LO)
+	{
+		return extract64(s->csr_val_addr, 0, 32);
+	}else if((int)offset == CSR_VAL_ADDR_HI)
+	{
+		return extract64(s->csr_val_addr, 32, 32);
+	}else if((int)offset == NNZ_REG)
+	{
+		return s->nnz_reg;
 	} else return 0xA0E0A0E0;
 
     return 0;
 }
 
+static uint64_t virt_mulmatr_read(void *opaque, hwaddr offset, unsigned size)
+{
+    uint64_t value = virt_mulmatr_reg_read(opaque, offset);
+
+    trace_virt_mulmatr_read(offset, value, size);
+    return value;
+}
+
 static void virt_mulmatr_write(void *opaque, hwaddr offset, uint64_t data,
                           unsigned size)
 {   
-    qemu_log_mask(CPU_LOG_MMU, "QEMU: Inside function (virt_mulmatr.c) virt_mulmatr_write. Writinng 0x%x on addr 0x%x\n",data, (uint32_t)offset);
-
     VirtMulMatrState *s = (VirtMulMatrState *)opaque;
 
-    if((int)offset >= MATR_A_START && (int)offset <= MATR_A_END && ((int)offset%4 == 0))
+    trace_virt_mulmatr_write(offset, data, size);
+
+    if((int)offset == SIZE_REG)
+	{
+		if (data > s->max_size) {
+            qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: size %u clamped to max-size %u\n",
+                          (uint32_t)data, s->max_size);
+        }
+		s->size_reg = (data <= s->max_size) ? (uint32_t)data : s->max_size;
+	}else if((int)offset == K_REG)
+	{
+		if (data == 0 || data > s->max_size) {
+            qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: k %u clamped to [1, %u]\n",
+                          (uint32_t)data, s->max_size);
+        }
+		s->k_reg = MIN(MAX((uint32_t)data, 1), s->max_size);
+	}else if((int)offset == SLOT_REG)
+	{
+		s->slot_reg = data;     //checked when the operation runs
+	}else if((int)offset == ALPHA_REG)
+	{
+		s->alpha_reg = (int32_t)data;
+	}else if((int)offset == BETA_REG)
+	{
+		s->beta_reg = (int32_t)data;
+	}else if((int)offset == DMA_A_ADDR_LO)
+	{
+		s->dma_a_addr = virt_mulmatr_set_lo(s->dma_a_addr, data);
+	}else if((int)offset == DMA_A_ADDR_HI)
+	{
+		s->dma_a_addr = virt_mulmatr_set_hi(s->dma_a_addr, data);
+	}else if((int)offset == DMA_B_ADDR_LO)
+	{
+		s->dma_b_addr = virt_mulmatr_set_lo(s->dma_b_addr, data);
+	}else if((int)offset == DMA_B_ADDR_HI)
+	{
+		s->dma_b_addr = virt_mulmatr_set_hi(s->dma_b_addr, data);
+	}else if((int)offset == DMA_C_ADDR_LO)
+	{
+		s->dma_c_addr = virt_mulmatr_set_lo(s->dma_c_addr, data);
+	}else if((int)offset == DMA_C_ADDR_HI)
+	{
+		s->dma_c_addr = virt_mulmatr_set_hi(s->dma_c_addr, data);
+	}else if((int)offset == CSR_COL_ADDR_LO)
+	{
+		s->csr_col_addr = virt_mulmatr_set_lo(s->csr_col_addr, data);
+	}else if((int)offset == CSR_COL_ADDR_HI)
+	{
+		s->csr_col_addr = virt_mulmatr_set_hi(s->csr_col_addr, data);
+	}else if((int)offset == CSR_VAL_ADDR_LO)
+	{
+		s->csr_val_addr = virt_mulmatr_set_lo(s->csr_val_addr, data);
+	}else if((int)offset == CSR_VAL_ADDR_HI)
+	{
+		s->csr_val_addr = virt_mulmatr_set_hi(s->csr_val_addr, data);
+	}else if((int)offset == NNZ_REG)
+	{
+		s->nnz_reg = data;      //checked against size x size when the operation runs
+	}else if((int)offset == SQ_TAIL_DB)
+	{
+		virt_mulmatr_doorbell(s, &s->sq_tail, data);
+	}else if((int)offset == CQ_HEAD_DB)
+	{
+		virt_mulmatr_doorbell(s, &s->cq_head, data);
+	}else if((int)offset >= SQ_BASE_LO && (int)offset <= Q_SIZE_REG && s->q_enabled)
 	{
-		s->matrA[((int)offset-MATR_A_START)/4] = (int32_t)data;
-	} else if((int)offset >= MATR_B_START && (int)offset <= MATR_B_END && ((int)offset%4 == 0))
+		qemu_log_mask(LOG_GUEST_ERROR, "virt-mulmatr: queue setup changed while enabled\n");
+	}else if((int)offset == SQ_BASE_LO)
 	{
-		s->matrB[((int)offset-MATR_B_START)/4] = (int32_t)data;
-	}else if((int)offset == SIZE_REG)
+		s->sq_base = virt_mulmatr_set_lo(s->sq_base, data);
+	}else if((int)offset == SQ_BASE_HI)
 	{
-		s->size_reg = (data <= 10) ? (uint32_t)data : 10;
+		s->sq_base = virt_mulmatr_set_hi(s->sq_base, data);
+	}else if((int)offset == CQ_BASE_LO)
+	{
+		s->cq_base = virt_mulmatr_set_lo(s->cq_base, data);
+	}else if((int)offset == CQ_BASE_HI)
+	{
+		s->cq_base = virt_mulmatr_set_hi(s->cq_base, data);
+	}else if((int)offset == Q_SIZE_REG)
+	{
+		s->q_size = data;
 	}else if((int)offset == CONTROL_REG)
 	{
-		s->control_reg = data;
+		bool queue_was_enabled = s->control_reg & BIT_C_QUEUE_EN;
 
-		if(data & BIT_C_START_OP)
-		{	//Start the operation
-			s->status_reg 	 |= BIT_S_OP_STARTED; //bit 0 = 1 Operation In progress
-			matrix_vector_multiply((int32_t *)s->matrA, (int32_t *)s->matrB, (int32_t *)s->matrC, (uint32_t)s->size_reg);
-			s->status_reg    |= BIT_S_OP_ENDED; //bit 1 = 1 Operation Ended
-            
-            if(s->control_reg & BIT_C_END_OP_IRQ_EN)
-                qemu_set_irq(s->irq, 1);
+		//start and resets are commands, they are not kept in the register
+		s->control_reg = data & ~(BIT_C_START_OP | BIT_C_RESET_STAT | BIT_C_CNT_RESET);
+
+		if (data & BIT_C_CNT_RESET)
+		{
+			virt_mulmatr_counters_reset(s);
+		}
 
+		if (queue_was_enabled != !!(s->control_reg & BIT_C_QUEUE_EN))
+		{
+			virt_mulmatr_queue_enable(s, s->control_reg & BIT_C_QUEUE_EN);
+		}
+
+		if(data & BIT_C_START_OP)
+		{	//Start the operation on the worker thread
+			virt_mulmatr_start(s);
 		} else if(data & BIT_C_RESET_STAT)
-		{	//Reset status Reg
-			s->status_reg = 0x0;
-            qemu_set_irq(s->irq, 0);
+		{	//Reset status Reg, a running operation stays busy
+			s->status_reg &= BIT_S_OP_STARTED;
+            virt_mulmatr_set_irq(s, 0);
 		}
 	}
 }
@@ -145,32 +1328,194 @@ static const MemoryRegionOps virt_mulmatr_ops = {
     .read = virt_mulmatr_read,
     .write = virt_mulmatr_write,
     .endianness = DEVICE_NATIVE_ENDIAN,
+    // 64 bit accesses are split in two 32 bit ones, e.g. a whole LO/HI pair
+    .valid = {
+        .min_access_size = 4,
+        .max_access_size = 8,
+    },
+    .impl = {
+        .min_access_size = 4,
+        .max_access_size = 4,
+    },
 };
 
-static void virt_mulmatr_realize(DeviceState *d, Error **errp)
+// Place the matrix windows: legacy offsets below the registers if asked for,
+// otherwise page aligned after the register page
+static void virt_mulmatr_layout(VirtMulMatrState *s)
 {
-    qemu_log_mask(CPU_LOG_MMU, "Inside function (virt_mulmatr.c) virt_mulmatr_realize ######################### QEMU #########################\n");
+    uint64_t n = s->max_size;
+
+    if (s->legacy_windows) {
+        s->matra_off = MATR_A_START;
+        s->matrb_off = MATR_B_START;
+        s->matrc_off = MATR_C_START;
+        s->mmio_size = REG_PAGE_END;
+        return;
+    }
 
+    s->matra_off = WIN_BASE;
+    s->matrb_off = s->matra_off + ROUND_UP(n * n * 4, WIN_ALIGN);
+    s->matrc_off = s->matrb_off + ROUND_UP(n * 4, WIN_ALIGN);
+    s->mmio_size = s->matrc_off + ROUND_UP(n * 4, WIN_ALIGN);
+}
+
+/*
+ * RAM behind a window of 'count' words at 'off', it takes precedence over the
+ * register callbacks. Page aligned windows are mapped straight into the guest,
+ * the legacy ones share the register page and go through the subpage path.
+ */
+static int32_t *virt_mulmatr_win_init(VirtMulMatrState *s, MemoryRegion *mr, const char *name,
+                                      hwaddr off, uint64_t count)
+{
+    uint64_t bytes = count * sizeof(int32_t);
+    size_t len = ROUND_UP(bytes, qemu_real_host_page_size);
+    int32_t *buf = qemu_memalign(qemu_real_host_page_size, len);
+
+    memset(buf, 0, len);
+    memory_region_init_ram_ptr(mr, OBJECT(s), name, bytes, buf);
+    memory_region_add_subregion(&s->iomem, off, mr);
+    return buf;
+}
+
+static void virt_mulmatr_win_fini(VirtMulMatrState *s, MemoryRegion *mr, int32_t *buf)
+{
+    memory_region_del_subregion(&s->iomem, mr);
+    object_unparent(OBJECT(mr));
+    qemu_vfree(buf);
+}
+
+static void virt_mulmatr_realize(DeviceState *d, Error **errp)
+{
     VirtMulMatrState *s = VIRT_MULMATR(d);
     SysBusDevice *sbd = SYS_BUS_DEVICE(d);
 
+    if (s->max_size == 0 || s->max_size > MAX_SIZE_LIMIT) {
+        error_setg(errp, "virt-mulmatr: max-size must be between 1 and %d", MAX_SIZE_LIMIT);
+        return;
+    }
+    if (s->num_slots > SLOTS_LIMIT) {
+        error_setg(errp, "virt-mulmatr: slots must be at most %d", SLOTS_LIMIT);
+        return;
+    }
+    if (s->compute_threads == 0 || s->compute_threads > COMPUTE_THREADS_LIMIT) {
+        error_setg(errp, "virt-mulmatr: compute-threads must be between 1 and %d",
+                   COMPUTE_THREADS_LIMIT);
+        return;
+    }
+    if (s->legacy_windows && s->max_size > LEGACY_MAX_SIZE) {
+        error_setg(errp, "virt-mulmatr: legacy-windows needs max-size at most %d",
+                   LEGACY_MAX_SIZE);
+        return;
+    }
+
+    virt_mulmatr_layout(s);
+    trace_virt_mulmatr_realize(s->max_size, s->num_slots, s->compute_threads,
+                               matrix_vector_kernel_name(MULMATR_SMALL_MAX + 1));
+    s->slots = g_new0(VirtMulMatrSlot, s->num_slots);
+
     memory_region_init_io(&s->iomem, OBJECT(s), &virt_mulmatr_ops, s,
-                          TYPE_VIRT_MULMATR, 0x500);
+                          TYPE_VIRT_MULMATR, s->mmio_size);
+    s->matrA = virt_mulmatr_win_init(s, &s->win_a, "virt-mulmatr.matrA", s->matra_off,
+                                     (uint64_t)s->max_size * s->max_size);
+    s->matrB = virt_mulmatr_win_init(s, &s->win_b, "virt-mulmatr.matrB", s->matrb_off, s->max_size);
+    s->matrC = virt_mulmatr_win_init(s, &s->win_c, "virt-mulmatr.matrC", s->matrc_off, s->max_size);
     sysbus_init_mmio(sbd, &s->iomem);
     sysbus_init_irq(sbd, &s->irq);
 
     s->id_reg = CHIP_ID; 
     s->control_reg = DEFAULT_CTRL_REG;
-    s->size_reg = DEFAULT_SIZE_REG;
+    s->size_reg = MIN(DEFAULT_SIZE_REG, s->max_size);
+    s->k_reg = DEFAULT_K_REG;
+    s->alpha_reg = DEFAULT_ALPHA_REG;
+    s->beta_reg = DEFAULT_BETA_REG;
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    s->done_bh = qemu_bh_new(virt_mulmatr_done_bh, s);
+    s->queue_bh = qemu_bh_new(virt_mulmatr_queue_bh, s);
+
+    // Without any timing property the device completes in zero virtual time
+    s->timing = s->timing_setup_ns || s->timing_macs_per_us || s->timing_mb_per_s;
+    s->done_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, virt_mulmatr_done, s);
+    s->queue_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, virt_mulmatr_queue_timer, s);
+    qemu_mutex_init(&s->pool_lock);
+    qemu_cond_init(&s->pool_cond);
+    qemu_cond_init(&s->pool_done);
+    s->helpers = g_new(QemuThread, s->compute_threads - 1);
+    for (uint32_t i = 0; i + 1 < s->compute_threads; i++) {
+        qemu_thread_create(&s->helpers[i], TYPE_VIRT_MULMATR "-compute", virt_mulmatr_helper, s,
+                           QEMU_THREAD_JOINABLE);
+    }
+    qemu_thread_create(&s->thread, TYPE_VIRT_MULMATR, virt_mulmatr_worker, s,
+                       QEMU_THREAD_JOINABLE);
 }
 
-static void virt_mulmatr_class_init(ObjectClass *klass, void *data)
+static void virt_mulmatr_unrealize(DeviceState *d, Error **errp)
 {
-    qemu_log_mask(CPU_LOG_MMU, "Inside function (virt_mulmatr.c) virt_mulmatr_class_init ######################### QEMU #########################\n");
+    VirtMulMatrState *s = VIRT_MULMATR(d);
+
+    qemu_mutex_lock(&s->lock);
+    s->stopping = true;
+    qemu_cond_signal(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+    qemu_thread_join(&s->thread);
 
+    // the worker is gone, no task is in flight
+    qemu_mutex_lock(&s->pool_lock);
+    s->pool_stopping = true;
+    qemu_cond_broadcast(&s->pool_cond);
+    qemu_mutex_unlock(&s->pool_lock);
+    for (uint32_t i = 0; i + 1 < s->compute_threads; i++) {
+        qemu_thread_join(&s->helpers[i]);
+    }
+    g_free(s->helpers);
+    qemu_cond_destroy(&s->pool_done);
+    qemu_cond_destroy(&s->pool_cond);
+    qemu_mutex_destroy(&s->pool_lock);
+
+    qemu_bh_delete(s->done_bh);
+    qemu_bh_delete(s->queue_bh);
+    timer_del(s->done_timer);
+    timer_free(s->done_timer);
+    timer_del(s->queue_timer);
+    timer_free(s->queue_timer);
+    qemu_cond_destroy(&s->cond);
+    qemu_mutex_destroy(&s->lock);
+
+    virt_mulmatr_win_fini(s, &s->win_a, s->matrA);
+    virt_mulmatr_win_fini(s, &s->win_b, s->matrB);
+    virt_mulmatr_win_fini(s, &s->win_c, s->matrC);
+    g_free(s->scratch_a);
+    g_free(s->scratch_b);
+    g_free(s->scratch_c);
+    g_free(s->scratch_acc);
+    g_free(s->scratch_idx);
+
+    for (uint32_t i = 0; i < s->num_slots; i++) {
+        g_free(s->slots[i].data);
+    }
+    g_free(s->slots);
+}
+
+static Property virt_mulmatr_properties[] = {
+    DEFINE_PROP_UINT32("max-size", VirtMulMatrState, max_size, DEFAULT_MAX_SIZE),
+    DEFINE_PROP_UINT32("slots", VirtMulMatrState, num_slots, DEFAULT_SLOTS),
+    DEFINE_PROP_BOOL("legacy-windows", VirtMulMatrState, legacy_windows, false),
+    DEFINE_PROP_UINT64("timing-setup-ns", VirtMulMatrState, timing_setup_ns, 0),
+    DEFINE_PROP_UINT64("timing-macs-per-us", VirtMulMatrState, timing_macs_per_us, 0),
+    DEFINE_PROP_UINT64("timing-mb-per-s", VirtMulMatrState, timing_mb_per_s, 0),
+    DEFINE_PROP_UINT32("compute-threads", VirtMulMatrState, compute_threads,
+                       DEFAULT_COMPUTE_THREADS),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void virt_mulmatr_class_init(ObjectClass *klass, void *data)
+{
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = virt_mulmatr_realize;
+    dc->unrealize = virt_mulmatr_unrealize;
+    dc->props = virt_mulmatr_properties;
 }
 
 static const TypeInfo virt_mulmatr_info = {
@@ -182,8 +1527,6 @@ static const TypeInfo virt_mulmatr_info = {
 
 static void virt_mulmatr_register_types(void)
 {
-    qemu_log_mask(CPU_LOG_MMU, "Inside function (virt_mulmatr.c) virt_mulmatr_register_types ######################### QEMU #########################\n");
-    
     type_register_static(&virt_mulmatr_info);
 }
 
@@ -0,0 +1,260 @@
+/*
+ * Throughput of the virt-mulmatr register path, without a guest.
+ *
+ * Every path runs complete jobs (operands in, start, poll, result out,
+ * status reset) for every size from 1 to BENCH_MAX_SIZE and reports jobs/s,
+ * accesses/s and ns per access. An access is one qtest command, a bulk
+ * transfer of a whole window counts as one.
+ *
+ *   QTEST_QEMU_BINARY=aarch64-softmmu/qemu-system-aarch64 \
+ *       tests/virt_mulmatr_bench -m perf --verbose
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqtest.h"
+
+//memory map of the virt machine with the device added by additions_virt.c
+#define MULMATR_BASE        0x0b000000
+#define RAM_BASE            0x40000000
+#define DMA_A               (RAM_BASE + 0x100000)
+#define DMA_B               (RAM_BASE + 0x200000)
+#define DMA_C               (RAM_BASE + 0x300000)
+
+//registers, see virt_mulmatr.c
+#define CONTROL_REG         0x400
+#define BIT_C_ENABLE        BIT(0)
+#define BIT_C_START_OP      BIT(2)
+#define BIT_C_RESET_STAT    BIT(3)
+#define BIT_C_DMA_MODE      BIT(4)
+#define CTRL_OP_GEMM        (1 << 12)
+#define SIZE_REG            0x410
+#define STATUS_REG          0x420
+#define BIT_S_OP_ENDED      BIT(1)
+#define BIT_S_DMA_ERR       BIT(2)
+#define BIT_S_CMD_ERR       BIT(3)
+#define ID_REG              0x430
+#define CHIP_ID             0xc1a0
+#define DMA_A_ADDR_LO       0x500
+#define DMA_B_ADDR_LO       0x510
+#define DMA_C_ADDR_LO       0x520
+#define CAP_MAX_SIZE_REG    0x600
+#define CAP_MATRA_OFF_REG   0x610
+#define CAP_MATRB_OFF_REG   0x620
+#define CAP_MATRC_OFF_REG   0x630
+#define K_REG               0x700
+
+#define BENCH_MAX_SIZE      64
+#define QUICK_JOBS          4       //jobs per size in the default (quick) mode
+#define PERF_JOBS           100     //jobs per size with -m perf
+
+typedef enum {
+    BENCH_MMIO32,       //windows word by word
+    BENCH_MMIO64,       //windows 8 bytes at a time
+    BENCH_BULK,         //a whole window per command
+    BENCH_DMA_GEMV,     //operands and result in guest RAM
+    BENCH_DMA_GEMM,     //same, B and C are size x size
+} BenchMode;
+
+typedef struct {
+    QTestState *qts;
+    uint32_t a_off;
+    uint32_t b_off;
+    uint32_t c_off;
+    uint64_t accesses;
+} Bench;
+
+static const char *const bench_names[] = {
+    [BENCH_MMIO32] = "mmio32",
+    [BENCH_MMIO64] = "mmio64",
+    [BENCH_BULK] = "bulk",
+    [BENCH_DMA_GEMV] = "dma-gemv",
+    [BENCH_DMA_GEMM] = "dma-gemm",
+};
+
+static uint32_t bench_readl(Bench *b, uint64_t off)
+{
+    b->accesses++;
+    return qtest_readl(b->qts, MULMATR_BASE + off);
+}
+
+static void bench_writel(Bench *b, uint64_t off, uint32_t val)
+{
+    b->accesses++;
+    qtest_writel(b->qts, MULMATR_BASE + off, val);
+}
+
+// 'count' words from/to guest address 'addr' with the access width of 'mode'
+static void bench_store(Bench *b, BenchMode mode, uint64_t addr, const int32_t *src,
+                        uint32_t count)
+{
+    uint32_t i = 0;
+
+    if (mode == BENCH_MMIO32 || mode == BENCH_MMIO64) {
+        for (; mode == BENCH_MMIO64 && i + 2 <= count; i += 2) {
+            b->accesses++;
+            qtest_writeq(b->qts, addr + i * 4,
+                         deposit64((uint32_t)src[i], 32, 32, (uint32_t)src[i + 1]));
+        }
+        for (; i < count; i++) {
+            b->accesses++;
+            qtest_writel(b->qts, addr + i * 4, src[i]);
+        }
+        return;
+    }
+
+    {
+        g_autofree int32_t *le = g_new(int32_t, count);
+
+        for (; i < count; i++) {
+            le[i] = cpu_to_le32(src[i]);
+        }
+        b->accesses++;
+        qtest_memwrite(b->qts, addr, le, count * 4);
+    }
+}
+
+static void bench_load(Bench *b, BenchMode mode, uint64_t addr, int32_t *dst, uint32_t count)
+{
+    uint32_t i = 0;
+
+    if (mode == BENCH_MMIO32 || mode == BENCH_MMIO64) {
+        for (; mode == BENCH_MMIO64 && i + 2 <= count; i += 2) {
+            uint64_t val;
+
+            b->accesses++;
+            val = qtest_readq(b->qts, addr + i * 4);
+            dst[i] = extract64(val, 0, 32);
+            dst[i + 1] = extract64(val, 32, 32);
+        }
+        for (; i < count; i++) {
+            b->accesses++;
+            dst[i] = qtest_readl(b->qts, addr + i * 4);
+        }
+        return;
+    }
+
+    b->accesses++;
+    qtest_memread(b->qts, addr, dst, count * 4);
+    for (; i < count; i++) {
+        dst[i] = le32_to_cpu(dst[i]);
+    }
+}
+
+// One complete job: operands, start, completion, result, status reset
+static void bench_job(Bench *b, BenchMode mode, uint32_t n, const int32_t *a, const int32_t *x,
+                      int32_t *c)
+{
+    bool dma = mode == BENCH_DMA_GEMV || mode == BENCH_DMA_GEMM;
+    uint32_t k = mode == BENCH_DMA_GEMM ? n : 1;
+    uint32_t ctrl = BIT_C_ENABLE | BIT_C_START_OP;
+    uint32_t status;
+
+    bench_store(b, mode, dma ? DMA_A : MULMATR_BASE + b->a_off, a, n * n);
+    bench_store(b, mode, dma ? DMA_B : MULMATR_BASE + b->b_off, x, n * k);
+    bench_writel(b, SIZE_REG, n);
+    if (dma) {
+        bench_writel(b, K_REG, k);
+        ctrl |= BIT_C_DMA_MODE | (mode == BENCH_DMA_GEMM ? CTRL_OP_GEMM : 0);
+    }
+    bench_writel(b, CONTROL_REG, ctrl);
+
+    // the job runs on the device worker thread, the main loop completes it
+    do {
+        status = bench_readl(b, STATUS_REG);
+    } while (!(status & BIT_S_OP_ENDED));
+    g_assert_cmphex(status & (BIT_S_DMA_ERR | BIT_S_CMD_ERR), ==, 0);
+
+    bench_load(b, mode, dma ? DMA_C : MULMATR_BASE + b->c_off, c, n * k);
+    bench_writel(b, CONTROL_REG, BIT_C_ENABLE | BIT_C_RESET_STAT);
+}
+
+static void bench_check(uint32_t n, uint32_t k, const int32_t *a, const int32_t *x,
+                        const int32_t *c)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t j = 0; j < k; j++) {
+            int64_t acc = 0;
+
+            for (uint32_t p = 0; p < n; p++) {
+                acc += (int64_t)a[i * n + p] * x[p * k + j];
+            }
+            g_assert_cmpint(c[i * k + j], ==, (int32_t)acc);
+        }
+    }
+}
+
+static void bench_report(const char *name, uint64_t jobs, uint64_t accesses, int64_t ns)
+{
+    double secs = ns / 1e9;
+
+    g_test_message("%s: %" PRIu64 " jobs, %.0f jobs/s, %.0f accesses/s, %.1f ns/access",
+                   name, jobs, jobs / secs, accesses / secs, (double)ns / accesses);
+}
+
+static void bench_run(gconstpointer data)
+{
+    BenchMode mode = GPOINTER_TO_INT(data);
+    uint32_t jobs = g_test_perf() ? PERF_JOBS : QUICK_JOBS;
+    g_autofree int32_t *a = g_new(int32_t, BENCH_MAX_SIZE * BENCH_MAX_SIZE);
+    g_autofree int32_t *x = g_new(int32_t, BENCH_MAX_SIZE * BENCH_MAX_SIZE);
+    g_autofree int32_t *c = g_new(int32_t, BENCH_MAX_SIZE * BENCH_MAX_SIZE);
+    uint64_t total_accesses = 0;
+    int64_t total_ns = 0;
+    Bench b = { 0 };
+
+    b.qts = qtest_initf("-machine virt -global virt-mulmatr.max-size=%d", BENCH_MAX_SIZE);
+    g_assert_cmphex(qtest_readl(b.qts, MULMATR_BASE + ID_REG), ==, CHIP_ID);
+    g_assert_cmpuint(qtest_readl(b.qts, MULMATR_BASE + CAP_MAX_SIZE_REG), ==, BENCH_MAX_SIZE);
+    b.a_off = qtest_readl(b.qts, MULMATR_BASE + CAP_MATRA_OFF_REG);
+    b.b_off = qtest_readl(b.qts, MULMATR_BASE + CAP_MATRB_OFF_REG);
+    b.c_off = qtest_readl(b.qts, MULMATR_BASE + CAP_MATRC_OFF_REG);
+    if (mode == BENCH_DMA_GEMV || mode == BENCH_DMA_GEMM) {
+        qtest_writel(b.qts, MULMATR_BASE + DMA_A_ADDR_LO, (uint32_t)DMA_A);
+        qtest_writel(b.qts, MULMATR_BASE + DMA_B_ADDR_LO, (uint32_t)DMA_B);
+        qtest_writel(b.qts, MULMATR_BASE + DMA_C_ADDR_LO, (uint32_t)DMA_C);
+    }
+
+    for (uint32_t i = 0; i < BENCH_MAX_SIZE * BENCH_MAX_SIZE; i++) {
+        a[i] = g_test_rand_int_range(-100, 100);
+        x[i] = g_test_rand_int_range(-100, 100);
+    }
+
+    for (uint32_t n = 1; n <= BENCH_MAX_SIZE; n++) {
+        int64_t start = g_get_monotonic_time();
+        int64_t ns;
+
+        b.accesses = 0;
+        for (uint32_t j = 0; j < jobs; j++) {
+            bench_job(&b, mode, n, a, x, c);
+        }
+        ns = (g_get_monotonic_time() - start) * 1000;
+
+        if (g_test_perf()) {
+            g_autofree char *name = g_strdup_printf("%s size %u", bench_names[mode], n);
+
+            bench_report(name, jobs, b.accesses, ns);
+        }
+        total_accesses += b.accesses;
+        total_ns += ns;
+
+        // the last result of every size is checked, outside of the timing
+        bench_check(n, mode == BENCH_DMA_GEMM ? n : 1, a, x, c);
+    }
+    bench_report(bench_names[mode], (uint64_t)jobs * BENCH_MAX_SIZE, total_accesses,
+                 MAX(total_ns, 1));
+
+    qtest_quit(b.qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    for (BenchMode mode = BENCH_MMIO32; mode <= BENCH_DMA_GEMM; mode++) {
+        g_autofree char *path = g_strdup_printf("/virt-mulmatr/bench/%s", bench_names[mode]);
+
+        qtest_add_data_func(path, GINT_TO_POINTER(mode), bench_run);
+    }
+
+    return g_test_run();
+}
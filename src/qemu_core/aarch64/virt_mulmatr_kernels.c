@@ -0,0 +1,314 @@
+#include "qemu/osdep.h"
+#include "virt_mulmatr_kernels.h"
+
+typedef void (*MulMatrGemvFn)(const int32_t *, const int32_t *, int32_t *, uint32_t, uint32_t);
+
+// Portable kernel, always available; 'rows' rows of 'size' columns
+static void gemv_scalar(const int32_t *matrix, const int32_t *vector,
+                        int32_t *result, uint32_t rows, uint32_t size)
+{
+    for (uint32_t row = 0; row < rows; row++) {
+        const int32_t *a = matrix + (size_t)row * size;
+        int64_t acc = 0;
+
+        for (uint32_t col = 0; col < size; col++) {
+            acc += (int64_t)a[col] * vector[col];
+        }
+        result[row] = (int32_t)acc;
+    }
+}
+
+/*
+ * Dot product of 'n' elements, n <= MULMATR_SMALL_MAX. Called with a
+ * constant 'n' the switch folds away and only the n products are left.
+ */
+static inline int64_t dot_small(const int32_t *a, const int32_t *b, const uint32_t n)
+{
+    int64_t acc = 0;
+
+    switch (n) {
+    case 16: acc += (int64_t)a[15] * b[15]; /* fall through */
+    case 15: acc += (int64_t)a[14] * b[14]; /* fall through */
+    case 14: acc += (int64_t)a[13] * b[13]; /* fall through */
+    case 13: acc += (int64_t)a[12] * b[12]; /* fall through */
+    case 12: acc += (int64_t)a[11] * b[11]; /* fall through */
+    case 11: acc += (int64_t)a[10] * b[10]; /* fall through */
+    case 10: acc += (int64_t)a[9] * b[9];   /* fall through */
+    case 9:  acc += (int64_t)a[8] * b[8];   /* fall through */
+    case 8:  acc += (int64_t)a[7] * b[7];   /* fall through */
+    case 7:  acc += (int64_t)a[6] * b[6];   /* fall through */
+    case 6:  acc += (int64_t)a[5] * b[5];   /* fall through */
+    case 5:  acc += (int64_t)a[4] * b[4];   /* fall through */
+    case 4:  acc += (int64_t)a[3] * b[3];   /* fall through */
+    case 3:  acc += (int64_t)a[2] * b[2];   /* fall through */
+    case 2:  acc += (int64_t)a[1] * b[1];   /* fall through */
+    case 1:  acc += (int64_t)a[0] * b[0];
+    }
+    return acc;
+}
+
+#define GEMV_FIXED(N)                                                       \
+static void gemv_##N(const int32_t *matrix, const int32_t *vector,         \
+                     int32_t *result, uint32_t rows, uint32_t size)         \
+{                                                                           \
+    for (uint32_t row = 0; row < N; row++) {                                \
+        result[row] = (int32_t)dot_small(matrix + row * N, vector, N);      \
+    }                                                                       \
+}
+
+GEMV_FIXED(1)
+GEMV_FIXED(2)
+GEMV_FIXED(3)
+GEMV_FIXED(4)
+GEMV_FIXED(5)
+GEMV_FIXED(6)
+GEMV_FIXED(7)
+GEMV_FIXED(8)
+GEMV_FIXED(9)
+GEMV_FIXED(10)
+GEMV_FIXED(11)
+GEMV_FIXED(12)
+GEMV_FIXED(13)
+GEMV_FIXED(14)
+GEMV_FIXED(15)
+GEMV_FIXED(16)
+
+static const MulMatrGemvFn gemv_small[MULMATR_SMALL_MAX + 1] = {
+    NULL,     gemv_1,   gemv_2,   gemv_3,   gemv_4,   gemv_5,
+    gemv_6,   gemv_7,   gemv_8,   gemv_9,   gemv_10,  gemv_11,
+    gemv_12,  gemv_13,  gemv_14,  gemv_15,  gemv_16,
+};
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+#include <smmintrin.h>
+
+/*
+ * _mm_mul_epi32 multiplies the even 32 bit lanes into 64 bit products,
+ * the odd lanes are shifted down to be multiplied the same way.
+ */
+static void gemv_sse4(const int32_t *matrix, const int32_t *vector,
+                      int32_t *result, uint32_t rows, uint32_t size)
+{
+    for (uint32_t row = 0; row < rows; row++) {
+        const int32_t *a = matrix + (size_t)row * size;
+        __m128i acc_even = _mm_setzero_si128();
+        __m128i acc_odd = _mm_setzero_si128();
+        int64_t lanes[2];
+        uint32_t col = 0;
+        int64_t acc;
+
+        for (; col + 4 <= size; col += 4) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + col));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(vector + col));
+
+            acc_even = _mm_add_epi64(acc_even, _mm_mul_epi32(va, vb));
+            acc_odd = _mm_add_epi64(acc_odd, _mm_mul_epi32(_mm_srli_epi64(va, 32),
+                                                           _mm_srli_epi64(vb, 32)));
+        }
+        _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc_even, acc_odd));
+        acc = lanes[0] + lanes[1];
+
+        for (; col < size; col++) {
+            acc += (int64_t)a[col] * vector[col];
+        }
+        result[row] = (int32_t)acc;
+    }
+}
+
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static void gemv_avx2(const int32_t *matrix, const int32_t *vector,
+                      int32_t *result, uint32_t rows, uint32_t size)
+{
+    for (uint32_t row = 0; row < rows; row++) {
+        const int32_t *a = matrix + (size_t)row * size;
+        __m256i acc_even = _mm256_setzero_si256();
+        __m256i acc_odd = _mm256_setzero_si256();
+        __m128i sum;
+        int64_t lanes[2];
+        uint32_t col = 0;
+        int64_t acc;
+
+        for (; col + 8 <= size; col += 8) {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(a + col));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(vector + col));
+
+            acc_even = _mm256_add_epi64(acc_even, _mm256_mul_epi32(va, vb));
+            acc_odd = _mm256_add_epi64(acc_odd, _mm256_mul_epi32(_mm256_srli_epi64(va, 32),
+                                                                 _mm256_srli_epi64(vb, 32)));
+        }
+        acc_even = _mm256_add_epi64(acc_even, acc_odd);
+        sum = _mm_add_epi64(_mm256_castsi256_si128(acc_even),
+                            _mm256_extracti128_si256(acc_even, 1));
+        _mm_storeu_si128((__m128i *)lanes, sum);
+        acc = lanes[0] + lanes[1];
+
+        for (; col < size; col++) {
+            acc += (int64_t)a[col] * vector[col];
+        }
+        result[row] = (int32_t)acc;
+    }
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+static MulMatrGemvFn gemv_large = gemv_scalar;
+static const char *gemv_large_name = "scalar";
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_gemv_kernels(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+
+    if (max < 1) {
+        return;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (c & bit_SSE4_1) {
+        gemv_large = gemv_sse4;
+        gemv_large_name = "sse4.1";
+    }
+
+    // AVX must be usable (OS saves the YMM state), not just available
+    if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+        int bv;
+
+        __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+        __cpuid_count(7, 0, a, b, c, d);
+        if ((bv & 6) == 6 && (b & bit_AVX2)) {
+            gemv_large = gemv_avx2;
+            gemv_large_name = "avx2";
+        }
+    }
+}
+#endif /* CONFIG_AVX2_OPT */
+
+void matrix_vector_multiply(const int32_t *matrix, const int32_t *vector,
+                            int32_t *result, uint32_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    if (size <= MULMATR_SMALL_MAX) {
+        gemv_small[size](matrix, vector, result, size, size);
+    } else {
+        gemv_large(matrix, vector, result, size, size);
+    }
+}
+
+/*
+ * Cache blocked GEMM: a TILE_ROWS x TILE_COLS block of the result is
+ * accumulated on 64 bit while TILE_INNER rows of 'b' (TILE_INNER x TILE_COLS
+ * words, 32 KiB) are reused from the cache for every row of the block.
+ */
+#define TILE_ROWS   32
+#define TILE_COLS   64
+#define TILE_INNER  128
+
+static void gemm_tiled(const int32_t *a, const int32_t *b, int32_t *result,
+                       uint32_t nrows, uint32_t size, uint32_t k)
+{
+    int64_t acc[TILE_ROWS][TILE_COLS];
+
+    for (uint32_t i0 = 0; i0 < nrows; i0 += TILE_ROWS) {
+        uint32_t rows = MIN(TILE_ROWS, nrows - i0);
+
+        for (uint32_t j0 = 0; j0 < k; j0 += TILE_COLS) {
+            uint32_t cols = MIN(TILE_COLS, k - j0);
+
+            for (uint32_t i = 0; i < rows; i++) {
+                memset(acc[i], 0, cols * sizeof(int64_t));
+            }
+
+            for (uint32_t p0 = 0; p0 < size; p0 += TILE_INNER) {
+                uint32_t inner = MIN(TILE_INNER, size - p0);
+
+                for (uint32_t i = 0; i < rows; i++) {
+                    const int32_t *arow = a + (size_t)(i0 + i) * size + p0;
+
+                    for (uint32_t p = 0; p < inner; p++) {
+                        const int32_t *brow = b + (size_t)(p0 + p) * k + j0;
+                        int64_t av = arow[p];
+
+                        for (uint32_t j = 0; j < cols; j++) {
+                            acc[i][j] += av * brow[j];
+                        }
+                    }
+                }
+            }
+
+            for (uint32_t i = 0; i < rows; i++) {
+                int32_t *crow = result + (size_t)(i0 + i) * k + j0;
+
+                for (uint32_t j = 0; j < cols; j++) {
+                    crow[j] = (int32_t)acc[i][j];
+                }
+            }
+        }
+    }
+}
+
+void matrix_matrix_multiply(const int32_t *a, const int32_t *b,
+                            int32_t *result, uint32_t size, uint32_t k)
+{
+    matrix_block_multiply(a, b, result, size, size, k);
+}
+
+void matrix_block_multiply(const int32_t *a, const int32_t *b, int32_t *result,
+                           uint32_t rows, uint32_t size, uint32_t k)
+{
+    if (rows == 0) {
+        return;
+    }
+    if (k == 1 && rows == size) {
+        matrix_vector_multiply(a, b, result, size);
+    } else if (k == 1) {
+        gemv_large(a, b, result, rows, size);
+    } else {
+        gemm_tiled(a, b, result, rows, size, k);
+    }
+}
+
+void matrix_sparse_multiply(const uint32_t *rowptr, const uint32_t *colidx,
+                            const int32_t *values, const int32_t *b,
+                            int32_t *result, uint32_t size, uint32_t k)
+{
+    int64_t acc[TILE_COLS];
+
+    for (uint32_t row = 0; row < size; row++) {
+        int32_t *crow = result + (size_t)row * k;
+
+        for (uint32_t j0 = 0; j0 < k; j0 += TILE_COLS) {
+            uint32_t cols = MIN(TILE_COLS, k - j0);
+
+            memset(acc, 0, cols * sizeof(int64_t));
+            for (uint32_t e = rowptr[row]; e < rowptr[row + 1]; e++) {
+                const int32_t *brow = b + (size_t)colidx[e] * k + j0;
+                int64_t av = values[e];
+
+                for (uint32_t j = 0; j < cols; j++) {
+                    acc[j] += av * brow[j];
+                }
+            }
+            for (uint32_t j = 0; j < cols; j++) {
+                crow[j0 + j] = (int32_t)acc[j];
+            }
+        }
+    }
+}
+
+const char *matrix_vector_kernel_name(uint32_t size)
+{
+    return size <= MULMATR_SMALL_MAX ? "unrolled" : gemv_large_name;
+}
@@ -0,0 +1,47 @@
+#ifndef HW_MISC_VIRT_MULMATR_KERNELS_H
+#define HW_MISC_VIRT_MULMATR_KERNELS_H
+
+// Biggest size served by a fully unrolled kernel
+#define MULMATR_SMALL_MAX   16
+
+/*
+ * result = matrix x vector, 'matrix' is size x size (row major).
+ * Products are accumulated on 64 bit and truncated to 32 bit when stored,
+ * i.e. the result wraps around as the original 32 bit loop did.
+ * The kernel is chosen from the size and the host CPU features.
+ */
+void matrix_vector_multiply(const int32_t *matrix, const int32_t *vector,
+                            int32_t *result, uint32_t size);
+
+/*
+ * result = a x b, 'a' is size x size, 'b' and 'result' are size x k
+ * (row major). Same accumulation rules as matrix_vector_multiply().
+ */
+void matrix_matrix_multiply(const int32_t *a, const int32_t *b,
+                            int32_t *result, uint32_t size, uint32_t k);
+
+/*
+ * Rows 'rows' of the product above: 'a' points to the first row of the
+ * block (rows x size) and 'result' to the matching row of the result
+ * (rows x k), 'b' is the whole size x k operand. Blocks of one product can
+ * be computed concurrently.
+ */
+void matrix_block_multiply(const int32_t *a, const int32_t *b, int32_t *result,
+                           uint32_t rows, uint32_t size, uint32_t k);
+
+/*
+ * result = a x b with 'a' in CSR form: the entries of row i are
+ * values[rowptr[i]] .. values[rowptr[i + 1] - 1], in the columns given by
+ * 'colidx'. Only the stored entries are multiplied; 'b' and 'result' are
+ * size x k. The indexes must have been validated by the caller.
+ * A block of rows is computed passing 'rowptr' and 'result' advanced to its
+ * first row and the block height as 'size'.
+ */
+void matrix_sparse_multiply(const uint32_t *rowptr, const uint32_t *colidx,
+                            const int32_t *values, const int32_t *b,
+                            int32_t *result, uint32_t size, uint32_t k);
+
+// Name of the kernel matrix_vector_multiply() uses for 'size', for logs
+const char *matrix_vector_kernel_name(uint32_t size);
+
+#endif
@@ -0,0 +1,280 @@
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "qemu/log.h"
+#include "qemu/bswap.h"
+#include "qemu/main-loop.h"
+#include "hw/virtio/virtio.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+#include "virt_mulmatr_kernels.h"
+
+#define TYPE_VIRTIO_MULMATR     "virtio-mulmatr-device"
+#define VIRTIO_MULMATR(obj)     OBJECT_CHECK(VirtIOMulMatr, (obj), TYPE_VIRTIO_MULMATR)
+
+//virtio device ID, not assigned by the virtio spec: the chip ID of virt-mulmatr
+#define VIRTIO_ID_MULMATR       0xc1a0
+
+#define QUEUE_SIZE              128
+#define DEFAULT_MAX_SIZE        256
+#define MAX_SIZE_LIMIT          4096
+
+/*
+ * A request is one descriptor chain:
+ *  out: header, A (size x size), B (size x k)
+ *  in:  C (size x k), status byte
+ * All words are little-endian int32, matrices row major.
+ */
+typedef struct {
+    uint32_t size;
+    uint32_t k;
+    uint32_t flags;         //reserved, must be 0
+    uint32_t reserved;
+} VirtIOMulMatrReqHdr;
+
+#define VIRTIO_MULMATR_S_OK     0
+#define VIRTIO_MULMATR_S_IOERR  1   //malformed request, nothing computed
+
+//config space, little-endian
+typedef struct {
+    uint32_t max_size;
+} VirtIOMulMatrConfig;
+
+typedef struct {
+    VirtIODevice parent_obj;
+    VirtQueue *vq;
+    uint32_t max_size;      //qdev property "max-size"
+    uint32_t inflight;      //requests on the thread pool, drained before a reset
+} VirtIOMulMatr;
+
+typedef struct {
+    VirtQueueElement elem;  //first, virtqueue_pop() allocates the whole request
+    VirtIOMulMatr *s;
+    uint32_t size;
+    uint32_t k;
+    int32_t *a;
+    int32_t *b;
+    int32_t *c;
+} VirtIOMulMatrReq;
+
+static void virtio_mulmatr_le32(int32_t *buf, uint64_t count)
+{
+    for (uint64_t i = 0; i < count; i++) {
+        buf[i] = le32_to_cpu(buf[i]);
+    }
+}
+
+// Give the element back to the guest with C (if any) and the status byte, which is
+// always the last byte of the in buffers, whatever C could be written
+static void virtio_mulmatr_finish(VirtIOMulMatrReq *req, uint8_t status)
+{
+    VirtIOMulMatr *s = req->s;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtQueueElement *elem = &req->elem;
+    size_t in_len = iov_size(elem->in_sg, elem->in_num);
+
+    // Malformed chain with nowhere to put the status: nothing written
+    if (in_len == 0) {
+        virtqueue_push(s->vq, elem, 0);
+        virtio_notify(vdev, s->vq);
+        return;
+    }
+
+    if (status == VIRTIO_MULMATR_S_OK) {
+        uint64_t len = (uint64_t)req->size * req->k;
+
+        for (uint64_t i = 0; i < len; i++) {
+            req->c[i] = cpu_to_le32(req->c[i]);
+        }
+        iov_from_buf(elem->in_sg, elem->in_num, 0, req->c, len * sizeof(int32_t));
+    }
+    iov_from_buf(elem->in_sg, elem->in_num, in_len - sizeof(status), &status, sizeof(status));
+
+    virtqueue_push(s->vq, elem, in_len);
+    virtio_notify(vdev, s->vq);
+}
+
+static void virtio_mulmatr_free(VirtIOMulMatrReq *req)
+{
+    g_free(req->a);
+    g_free(req->b);
+    g_free(req->c);
+    g_free(req);
+}
+
+// Thread pool worker, the request is owned by this job until it completes
+static int virtio_mulmatr_work(void *opaque)
+{
+    VirtIOMulMatrReq *req = opaque;
+
+    matrix_matrix_multiply(req->a, req->b, req->c, req->size, req->k);
+    return 0;
+}
+
+// Back in the main loop with the BQL held
+static void virtio_mulmatr_done(void *opaque, int ret)
+{
+    VirtIOMulMatrReq *req = opaque;
+    VirtIOMulMatr *s = req->s;
+
+    s->inflight--;
+    virtio_mulmatr_finish(req, VIRTIO_MULMATR_S_OK);
+    virtio_mulmatr_free(req);
+}
+
+// Check the chain and copy the operands out of it, false if it is malformed
+static bool virtio_mulmatr_parse(VirtIOMulMatr *s, VirtIOMulMatrReq *req)
+{
+    VirtQueueElement *elem = &req->elem;
+    VirtIOMulMatrReqHdr hdr;
+    uint64_t quad, len;
+
+    if (iov_to_buf(elem->out_sg, elem->out_num, 0, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        return false;
+    }
+    req->size = le32_to_cpu(hdr.size);
+    req->k = le32_to_cpu(hdr.k);
+    if (req->size == 0 || req->size > s->max_size || req->k == 0 || req->k > s->max_size ||
+        le32_to_cpu(hdr.flags)) {
+        return false;
+    }
+
+    quad = (uint64_t)req->size * req->size;
+    len = (uint64_t)req->size * req->k;
+    if (iov_size(elem->out_sg, elem->out_num) != sizeof(hdr) + (quad + len) * sizeof(int32_t) ||
+        iov_size(elem->in_sg, elem->in_num) < len * sizeof(int32_t) + 1) {
+        return false;
+    }
+
+    req->a = g_new(int32_t, quad);
+    req->b = g_new(int32_t, len);
+    req->c = g_new(int32_t, len);
+    iov_to_buf(elem->out_sg, elem->out_num, sizeof(hdr), req->a, quad * sizeof(int32_t));
+    iov_to_buf(elem->out_sg, elem->out_num, sizeof(hdr) + quad * sizeof(int32_t),
+               req->b, len * sizeof(int32_t));
+    virtio_mulmatr_le32(req->a, quad);
+    virtio_mulmatr_le32(req->b, len);
+    return true;
+}
+
+static void virtio_mulmatr_submit(VirtIOMulMatr *s, VirtIOMulMatrReq *req)
+{
+    req->s = s;
+    req->a = req->b = req->c = NULL;
+
+    if (!virtio_mulmatr_parse(s, req)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "virtio-mulmatr: malformed request\n");
+        req->size = 0;
+        virtio_mulmatr_finish(req, VIRTIO_MULMATR_S_IOERR);
+        virtio_mulmatr_free(req);
+        return;
+    }
+
+    // the product runs off the BQL, requests of the same kick run in parallel
+    s->inflight++;
+    thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
+                           virtio_mulmatr_work, req, virtio_mulmatr_done, req);
+}
+
+/*
+ * Kick handler: notifications stay off while the ring is drained, so a guest
+ * queueing many requests only exits once.
+ */
+static void virtio_mulmatr_handle_request(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIOMulMatr *s = VIRTIO_MULMATR(vdev);
+    VirtIOMulMatrReq *req;
+
+    do {
+        virtio_queue_set_notification(vq, 0);
+        while ((req = virtqueue_pop(vq, sizeof(VirtIOMulMatrReq)))) {
+            virtio_mulmatr_submit(s, req);
+        }
+        virtio_queue_set_notification(vq, 1);
+    } while (!virtio_queue_empty(vq));
+}
+
+static void virtio_mulmatr_get_config(VirtIODevice *vdev, uint8_t *config_data)
+{
+    VirtIOMulMatr *s = VIRTIO_MULMATR(vdev);
+    VirtIOMulMatrConfig config;
+
+    stl_le_p(&config.max_size, s->max_size);
+    memcpy(config_data, &config, sizeof(config));
+}
+
+static uint64_t virtio_mulmatr_get_features(VirtIODevice *vdev, uint64_t features, Error **errp)
+{
+    return features;
+}
+
+// Let the requests on the thread pool complete, they still point to the queue
+static void virtio_mulmatr_drain(VirtIOMulMatr *s)
+{
+    while (s->inflight) {
+        aio_poll(qemu_get_aio_context(), true);
+    }
+}
+
+static void virtio_mulmatr_reset(VirtIODevice *vdev)
+{
+    virtio_mulmatr_drain(VIRTIO_MULMATR(vdev));
+}
+
+static void virtio_mulmatr_realize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VirtIOMulMatr *s = VIRTIO_MULMATR(dev);
+
+    if (s->max_size == 0 || s->max_size > MAX_SIZE_LIMIT) {
+        error_setg(errp, "virtio-mulmatr: max-size must be between 1 and %d", MAX_SIZE_LIMIT);
+        return;
+    }
+
+    virtio_init(vdev, "virtio-mulmatr", VIRTIO_ID_MULMATR, sizeof(VirtIOMulMatrConfig));
+    s->vq = virtio_add_queue(vdev, QUEUE_SIZE, virtio_mulmatr_handle_request);
+}
+
+static void virtio_mulmatr_unrealize(DeviceState *dev, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(dev);
+    VirtIOMulMatr *s = VIRTIO_MULMATR(dev);
+
+    virtio_mulmatr_drain(s);
+    virtio_del_queue(vdev, 0);
+    virtio_cleanup(vdev);
+}
+
+static Property virtio_mulmatr_properties[] = {
+    DEFINE_PROP_UINT32("max-size", VirtIOMulMatr, max_size, DEFAULT_MAX_SIZE),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void virtio_mulmatr_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    VirtioDeviceClass *vdc = VIRTIO_DEVICE_CLASS(klass);
+
+    dc->props = virtio_mulmatr_properties;
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+    vdc->realize = virtio_mulmatr_realize;
+    vdc->unrealize = virtio_mulmatr_unrealize;
+    vdc->get_config = virtio_mulmatr_get_config;
+    vdc->get_features = virtio_mulmatr_get_features;
+    vdc->reset = virtio_mulmatr_reset;
+}
+
+static const TypeInfo virtio_mulmatr_info = {
+    .name          = TYPE_VIRTIO_MULMATR,
+    .parent        = TYPE_VIRTIO_DEVICE,
+    .instance_size = sizeof(VirtIOMulMatr),
+    .class_init    = virtio_mulmatr_class_init,
+};
+
+static void virtio_mulmatr_register_types(void)
+{
+    type_register_static(&virtio_mulmatr_info);
+}
+
+type_init(virtio_mulmatr_register_types)
@@ -5,6 +5,10 @@
 #include <sys/ioctl.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 
 // IOCTL command definitions for communication with the device
 #define RD_ID               _IOR('a','b',int32_t*)
@@ -25,9 +29,60 @@
 #define WR_MATRB            _IOR('a','o',int32_t*)
 #define RD_MATRC            _IOR('a','p',int32_t*)
 
+// C = A x B in a single call, A can be a matrix loaded in a device slot
+struct mulmatr_gemm {
+    uint32_t size;
+    uint32_t k;
+    int32_t *a;
+    int32_t *b;
+    int32_t *c;
+    uint32_t slot;          // Handle from MULMATR_SLOT_LOAD, 0 to send 'a'
+    uint32_t pad;
+};
+
+struct mulmatr_slot {
+    uint32_t handle;
+    uint32_t size;
+    int32_t *a;
+    uint32_t flags;
+    uint32_t pad;
+};
+
+#define MULMATR_SLOT_PINNED 0x1
+
+#define MULMATR_GEMM        _IOWR('a','q',struct mulmatr_gemm)
+#define MULMATR_SLOT_LOAD   _IOWR('a','s',struct mulmatr_slot)
+#define MULMATR_SLOT_PIN    _IOW('a','t',struct mulmatr_slot)
+#define MULMATR_SLOT_FREE   _IOW('a','u',uint32_t)
+
+// C = A x b in one call, the driver waits for the end of the operation
+struct mulmatr_submit {
+    uint32_t size;
+    uint32_t flags;         // MULMATR_SUBMIT_KEEP_A to reuse the A already in the device
+    int32_t *a;
+    int32_t *b;
+    int32_t *c;
+};
+
+#define MULMATR_SUBMIT_KEEP_A   0x1
+
+#define MULMATR_SUBMIT      _IOWR('a','A',struct mulmatr_submit)
+#define MULMATR_SET_EVENTFD _IOW('a','C',int32_t)
+
+// File offset of the windows with the page aligned layout, page 0 holds the registers
+#define WINDOWS_MMAP_OFF    0x4000
+
+// Node spreading the GEMMs over all the instances
+#define LB_DEVICE_PATH      "/dev/mulmatr"
+
+// Status register bits
+#define BIT_S_OP_STARTED    0x1     // Operation running (device busy)
+#define BIT_S_OP_ENDED      0x2     // Operation finished
+
 void print_usage(const char *prog_name) {
     printf("Usage: %s [-p device_path] [-s size_matrices] [-h]\n", prog_name);
-    printf("  -p device_file_path   : Specify the path to the device file (default: /dev/mulmatr_core)\n");
+    printf("  -p device_file_path   : Specify the path to the device file (default: /dev/mulmatr_core,\n");
+    printf("                          /dev/mulmatr_core<N> for the other instances, %s to balance)\n", LB_DEVICE_PATH);
     printf("  -s size matrix        : Set matrices size (default: 4)\n");
     printf("  -a mat_a_file         : Set matrix A file path (default: /root/matrix_a.txt)\n");
     printf("  -b mat_b_file         : Set matrix B file path (default: /root/matrix_b.txt)\n");
@@ -65,6 +120,190 @@ void print_matrix(int32_t *mat, int rows, int cols){
     }
 }
 
+// C = A x B on the host, the device accumulates in 64 bits and keeps the low 32
+void host_mul(const int32_t *mat_a, const int32_t *mat_b, int32_t *mat_c, int size){
+
+    for (int i = 0; i < size; i++) {
+        int64_t acc = 0;
+        for (int j = 0; j < size; j++) {
+            acc += (int64_t)mat_a[i * size + j] * mat_b[j];
+        }
+        mat_c[i] = (int32_t)acc;
+    }
+}
+
+// Compare C with the host product, -1 on the first difference
+int check_result(const char *what, const int32_t *mat_c, const int32_t *ref_c, int size){
+
+    for (int i = 0; i < size; i++) {
+        if (mat_c[i] != ref_c[i]) {
+            printf("%s: C[%d] is %d, expected %d\n", what, i, mat_c[i], ref_c[i]);
+            return -1;
+        }
+    }
+    printf("%s: result correct\n", what);
+    return 0;
+}
+
+// The operation of the file ended: poll() reports it, read() returns 'expected' ends
+// of operation of this file and the eventfd was signalled once; 1 if there is no IRQ line
+int check_own_event(int fd, int efd, uint32_t expected){
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint32_t events;
+    uint64_t signals;
+
+    if (poll(&pfd, 1, 1000) < 0) {
+        perror("Error calling poll");
+        return -1;
+    }
+    if (pfd.revents & POLLERR) {
+        printf("No IRQ line, read()/poll()/eventfd checks skipped\n");
+        return 1;
+    }
+    if (!(pfd.revents & POLLIN)) {
+        printf("poll() did not report the end of the operation\n");
+        return -1;
+    }
+    if (read(fd, &events, sizeof(events)) != sizeof(events)) {
+        perror("Error calling read");
+        return -1;
+    }
+    if (events != expected) {
+        printf("read() returned %u ends of operation, expected %u\n", events, expected);
+        return -1;
+    }
+    if (read(efd, &signals, sizeof(signals)) != sizeof(signals) || signals != 1) {
+        printf("eventfd not signalled once for the operation\n");
+        return -1;
+    }
+    printf("End of operation seen by poll(), read() and the eventfd\n");
+    return 0;
+}
+
+// The one-call ioctls are not operations of the file: nothing new to report
+int check_no_event(int fd, int efd){
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    uint64_t signals;
+
+    if (poll(&pfd, 1, 0) < 0) {
+        perror("Error calling poll");
+        return -1;
+    }
+    if (pfd.revents & POLLIN) {
+        printf("poll() reported an operation the file did not start\n");
+        return -1;
+    }
+    if (read(efd, &signals, sizeof(signals)) >= 0 || errno != EAGAIN) {
+        printf("eventfd signalled for an operation the file did not start\n");
+        return -1;
+    }
+    printf("No event for the one-call ioctls\n");
+    return 0;
+}
+
+// MULMATR_GEMM and MULMATR_SUBMIT through the balancing node: the GEMM runs on the
+// least loaded instance, the submit on the one the file is bound to
+int run_balanced(int32_t *mat_a, int32_t *mat_b, const int32_t *ref_c, int size_mat){
+
+    int32_t *ret_mat_c = (int32_t*)calloc(size_mat, sizeof(int32_t));
+    int ret = -1;
+    int fd;
+
+    if (!ret_mat_c)
+        return -1;
+
+    fd = open(LB_DEVICE_PATH, O_RDWR);
+    if (fd < 0) {
+        free(ret_mat_c);
+        // Module loaded with lb_node=0
+        if (errno == ENOENT) {
+            printf("%s not present, balanced run skipped\n", LB_DEVICE_PATH);
+            return 0;
+        }
+        perror("Error opening " LB_DEVICE_PATH);
+        return -1;
+    }
+
+    struct mulmatr_gemm job = { .size = size_mat, .k = 1, .a = mat_a, .b = mat_b, .c = ret_mat_c };
+    if (ioctl(fd, MULMATR_GEMM, &job) < 0) {
+        perror("Error calling ioctl MULMATR_GEMM on " LB_DEVICE_PATH);
+        goto out;
+    }
+    printf("Matrix C from balanced MULMATR_GEMM: ");
+    print_matrix(ret_mat_c, 1, size_mat);
+    if (check_result("Balanced MULMATR_GEMM", ret_mat_c, ref_c, size_mat) < 0)
+        goto out;
+
+    struct mulmatr_submit sub = { .size = size_mat, .a = mat_a, .b = mat_b, .c = ret_mat_c };
+    memset(ret_mat_c, 0, size_mat * sizeof(int32_t));
+    if (ioctl(fd, MULMATR_SUBMIT, &sub) < 0) {
+        perror("Error calling ioctl MULMATR_SUBMIT on " LB_DEVICE_PATH);
+        goto out;
+    }
+    printf("Matrix C from balanced MULMATR_SUBMIT: ");
+    print_matrix(ret_mat_c, 1, size_mat);
+    if (check_result("Balanced MULMATR_SUBMIT", ret_mat_c, ref_c, size_mat) < 0)
+        goto out;
+
+    ret = 0;
+out:
+    close(fd);
+    free(ret_mat_c);
+    return ret;
+}
+
+// mmap() of the device: page 0 only with mmap_regs, a mapping keeps the device to its file
+int run_mapped(const char *file_path){
+
+    long page = sysconf(_SC_PAGESIZE);
+    void *map;
+    int ret = -1;
+    int fd, fd2;
+
+    fd = open(file_path, O_RDWR);
+    if (fd < 0) {
+        perror("Error opening device file for mmap");
+        return -1;
+    }
+
+    map = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+        printf("Register page mapped (mmap_regs set)\n");
+        munmap(map, page);
+    } else if (errno != EPERM) {
+        perror("Error mapping the register page");
+        goto out;
+    }
+
+    map = mmap(NULL, page, PROT_READ | PROT_WRITE, MAP_SHARED, fd, WINDOWS_MMAP_OFF);
+    if (map == MAP_FAILED) {
+        // Legacy layout: the windows are in page 0
+        if (errno == EINVAL) {
+            printf("No window page to map, mmap checks skipped\n");
+            ret = 0;
+        } else {
+            perror("Error mapping the window page");
+        }
+        goto out;
+    }
+
+    fd2 = open(file_path, O_RDWR);
+    if (fd2 >= 0 || errno != EBUSY) {
+        printf("Mapped device opened by a second file\n");
+        if (fd2 >= 0)
+            close(fd2);
+    } else {
+        printf("Window page mapped, second open refused\n");
+        ret = 0;
+    }
+    munmap(map, page);
+out:
+    close(fd);
+    return ret;
+}
+
 int main(int argc, char *argv[]) {
 
     int opt;
@@ -83,7 +322,7 @@ int main(int argc, char *argv[]) {
     
     
     // Parsing command line arguments
-    while ((opt = getopt(argc, argv, "p:s:h")) != -1) {
+    while ((opt = getopt(argc, argv, "p:s:a:b:h")) != -1) {
         switch (opt) {
             case 'p':
                 file_path = optarg;
@@ -148,6 +387,10 @@ int main(int argc, char *argv[]) {
     printf("Matrix B loaded from file:\n");
     print_matrix(mat_b, size_mat, 1);
 
+    // Expected result of every multiplication below
+    int32_t *ref_mat_c = (int32_t*)malloc(size_mat * sizeof(int32_t));
+    host_mul(mat_a, mat_b, ref_mat_c, size_mat);
+
     // Open device file
     fd = open(file_path, O_RDWR);
     if (fd < 0) {
@@ -213,6 +456,21 @@ int main(int argc, char *argv[]) {
     }
     printf("Status read before start: %d\n", status);
 
+    // Have the end of the operation signalled: IRQ on, and an eventfd beside read()/poll()
+    int efd = eventfd(0, EFD_NONBLOCK);
+    if (efd < 0) {
+        perror("Error creating eventfd");
+        return EXIT_FAILURE;
+    }
+    if (ioctl(fd, CTRL_ENABLE_IRQ, NULL) < 0) {
+        perror("Error calling ioctl CTRL_ENABLE_IRQ");
+        return EXIT_FAILURE;
+    }
+    if (ioctl(fd, MULMATR_SET_EVENTFD, &efd) < 0) {
+        perror("Error calling ioctl MULMATR_SET_EVENTFD");
+        return EXIT_FAILURE;
+    }
+
     // Start operation
     if (ioctl(fd, CTRL_START_OP, NULL) < 0) {
         perror("Error calling ioctl CTRL_START_OP");
@@ -220,6 +478,11 @@ int main(int argc, char *argv[]) {
     }
     printf("Operation started\n");
 
+    // Before any RD_STATUS: reading the status register lowers the IRQ
+    int have_irq = check_own_event(fd, efd, 1);
+    if (have_irq < 0)
+        return EXIT_FAILURE;
+
     // Read status after start
     if (ioctl(fd, RD_STATUS, &status) < 0) {
         perror("Error calling ioctl RD_STATUS");
@@ -227,6 +490,15 @@ int main(int argc, char *argv[]) {
     }
     printf("Status read after start: %d\n", status);
 
+    // The device computes asynchronously, wait for the end of the operation
+    while (!(status & BIT_S_OP_ENDED)) {
+        if (ioctl(fd, RD_STATUS, &status) < 0) {
+            perror("Error calling ioctl RD_STATUS");
+            return EXIT_FAILURE;
+        }
+    }
+    printf("Status read at operation end: %d\n", status);
+
     // Read result vector
     if (ioctl(fd, RD_MATRC, ret_mat_c) < 0) {
         perror("Error calling ioctl RD_MATRC");
@@ -234,6 +506,8 @@ int main(int argc, char *argv[]) {
     }
     printf("Matrix C: ");
     print_matrix(ret_mat_c, 1, size_mat);
+    if (check_result("CTRL_START_OP", ret_mat_c, ref_mat_c, size_mat) < 0)
+        return EXIT_FAILURE;
 
     // Read status before reset
     if (ioctl(fd, RD_STATUS, &status) < 0) {
@@ -256,9 +530,61 @@ int main(int argc, char *argv[]) {
     }
     printf("Status read before reset: %d\n", status);
 
+    // Keep A in the device: from now on only B is uploaded
+    struct mulmatr_slot slot = { .size = size_mat, .a = mat_a, .flags = MULMATR_SLOT_PINNED };
+    if (ioctl(fd, MULMATR_SLOT_LOAD, &slot) < 0) {
+        perror("Error calling ioctl MULMATR_SLOT_LOAD");
+    } else {
+        printf("Matrix A loaded in slot handle 0x%x\n", slot.handle);
+
+        struct mulmatr_gemm job = { .size = size_mat, .k = 1, .b = mat_b,
+                                    .c = ret_mat_c, .slot = slot.handle };
+        memset(ret_mat_c, 0, size_mat * sizeof(int32_t));
+        if (ioctl(fd, MULMATR_GEMM, &job) < 0) {
+            perror("Error calling ioctl MULMATR_GEMM");
+            return EXIT_FAILURE;
+        }
+        printf("Matrix C from slot: ");
+        print_matrix(ret_mat_c, 1, size_mat);
+        if (check_result("Slot MULMATR_GEMM", ret_mat_c, ref_mat_c, size_mat) < 0)
+            return EXIT_FAILURE;
+
+        if (ioctl(fd, MULMATR_SLOT_FREE, &slot.handle) < 0) {
+            perror("Error calling ioctl MULMATR_SLOT_FREE");
+            return EXIT_FAILURE;
+        }
+        printf("Slot freed\n");
+    }
+
+    // The same multiplication in a single call
+    struct mulmatr_submit sub = { .size = size_mat, .a = mat_a, .b = mat_b, .c = ret_mat_c };
+    memset(ret_mat_c, 0, size_mat * sizeof(int32_t));
+    if (ioctl(fd, MULMATR_SUBMIT, &sub) < 0) {
+        perror("Error calling ioctl MULMATR_SUBMIT");
+        return EXIT_FAILURE;
+    }
+    printf("Matrix C from MULMATR_SUBMIT: ");
+    print_matrix(ret_mat_c, 1, size_mat);
+    if (check_result("MULMATR_SUBMIT", ret_mat_c, ref_mat_c, size_mat) < 0)
+        return EXIT_FAILURE;
+
+    // The slot GEMM and the submit ended on the IRQ too, but not as operations of the file
+    if (have_irq == 0 && check_no_event(fd, efd) < 0)
+        return EXIT_FAILURE;
+    close(efd);
+
     // close file
     close(fd);
     printf("File closed correctly\n");
 
+    // The same calls again through the balancing node, unless it was the node under test
+    if (strcmp(file_path, LB_DEVICE_PATH) != 0 &&
+        run_balanced(mat_a, mat_b, ref_mat_c, size_mat) < 0)
+        return EXIT_FAILURE;
+
+    // A mapping needs the single open file of an instance
+    if (strcmp(file_path, LB_DEVICE_PATH) != 0 && run_mapped(file_path) < 0)
+        return EXIT_FAILURE;
+
     return EXIT_SUCCESS;
 }